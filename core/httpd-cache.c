@@ -0,0 +1,176 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Cache of responses of routes with a cacheTtlMs, so a status page polled by a handful of clients is
+built once per TTL instead of once per request. Entries are kept in a short list per server
+instance; everything here runs with the server locked.
+*/
+
+#ifdef linux
+#include <libesphttpd/linux.h>
+#else
+#include <libesphttpd/esp.h>
+#endif
+
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+#include "libesphttpd/httpd.h"
+#include "httpd-platform.h"
+#include "httpd-cache.h"
+#include "esp_log.h"
+
+const static char* TAG = "httpd-cache";
+
+#ifndef CONFIG_ESPHTTPD_RESPONSE_CACHE_ENTRIES
+#define CONFIG_ESPHTTPD_RESPONSE_CACHE_ENTRIES 8
+#endif
+
+#ifndef CONFIG_ESPHTTPD_RESPONSE_CACHE_MAX_LEN
+#define CONFIG_ESPHTTPD_RESPONSE_CACHE_MAX_LEN 4096
+#endif
+
+//Requests with more GET arguments than this aren't cached.
+#define MAX_ARGS 16
+
+static bool ICACHE_FLASH_ATTR isStale(HttpdCacheEntry *e, uint32_t now) {
+	return (int32_t)(now - e->expires) >= 0;
+}
+
+//Compares two GET arguments, each ending at a '&' or the end of the string.
+static int ICACHE_FLASH_ATTR argCmp(const char *a, const char *b) {
+	while (*a && *a!='&' && *a==*b) {
+		a++;
+		b++;
+	}
+	return (*a=='&' ? 0 : (unsigned char)*a) - (*b=='&' ? 0 : (unsigned char)*b);
+}
+
+bool ICACHE_FLASH_ATTR httpdCacheMakeKey(const char *url, const char *getArgs, char *key, int len) {
+	const char *args[MAX_ARGS];
+	const char *p, *t;
+	int n=0, i, j, l, pos;
+
+	pos=strlen(url);
+	if (pos>=len) return false;
+	memcpy(key, url, pos);
+	for (p=getArgs; p!=NULL && *p; p+=(*p=='&')) {
+		if (*p!='&') {
+			if (n==MAX_ARGS) return false;
+			//Insertion sort, there are only a few of them.
+			for (i=n; i>0 && argCmp(args[i-1], p)>0; i--) args[i]=args[i-1];
+			args[i]=p;
+			n++;
+		}
+		while (*p && *p!='&') p++;
+	}
+	for (j=0; j<n; j++) {
+		t=args[j];
+		l=strcspn(t, "&");
+		if (pos+l+2>len) return false;
+		key[pos++]=(j==0)?'?':'&';
+		memcpy(key+pos, t, l);
+		pos+=l;
+	}
+	key[pos]=0;
+	return true;
+}
+
+//Unlinks an entry from the cache and drops the cache's reference to it.
+static void ICACHE_FLASH_ATTR removeEntry(HttpdInstance *pInstance, HttpdCacheEntry **pp) {
+	HttpdCacheEntry *e=*pp;
+	*pp=e->next;
+	pInstance->respCacheCount--;
+	httpdCacheRelease(e);
+}
+
+HttpdCacheEntry ICACHE_FLASH_ATTR *httpdCacheGet(HttpdInstance *pInstance, const char *key) {
+	HttpdCacheEntry **pp;
+	uint32_t now=httpdPlatGetTimeMs();
+
+	for (pp=&pInstance->respCache; *pp!=NULL; pp=&(*pp)->next) {
+		if (strcmp((*pp)->key, key)!=0) continue;
+		if (isStale(*pp, now)) {
+			removeEntry(pInstance, pp);
+			return NULL;
+		}
+		(*pp)->refs++;
+		return *pp;
+	}
+	return NULL;
+}
+
+HttpdCacheEntry ICACHE_FLASH_ATTR *httpdCacheNew(const char *route, const char *key, int ttlMs) {
+	HttpdCacheEntry *e=calloc(1, sizeof(HttpdCacheEntry)+strlen(key)+1);
+	if (e==NULL) return NULL;
+	strcpy(e->key, key);
+	e->route=route;
+	e->refs=1;
+	//Counted from the start of the response, the data is as old as that.
+	e->expires=httpdPlatGetTimeMs()+ttlMs;
+	return e;
+}
+
+bool ICACHE_FLASH_ATTR httpdCacheAppend(HttpdCacheEntry *e, const char *data, int len) {
+	char *p;
+	int size;
+	if (e->len+len>CONFIG_ESPHTTPD_RESPONSE_CACHE_MAX_LEN) {
+		ESP_LOGD(TAG, "%s too large to cache", e->key);
+		return false;
+	}
+	if (e->len+len>e->size) {
+		size=e->size?e->size*2:256;
+		while (size<e->len+len) size*=2;
+		if (size>CONFIG_ESPHTTPD_RESPONSE_CACHE_MAX_LEN) size=CONFIG_ESPHTTPD_RESPONSE_CACHE_MAX_LEN;
+		p=realloc(e->data, size);
+		if (p==NULL) return false;
+		e->data=p;
+		e->size=size;
+	}
+	memcpy(e->data+e->len, data, len);
+	e->len+=len;
+	return true;
+}
+
+void ICACHE_FLASH_ATTR httpdCachePut(HttpdInstance *pInstance, HttpdCacheEntry *e) {
+	HttpdCacheEntry **pp, **victim=NULL;
+	uint32_t now=httpdPlatGetTimeMs();
+
+	//Drop the stale entries and the one this replaces, and find the one to evict if it's full.
+	pp=&pInstance->respCache;
+	while (*pp!=NULL) {
+		if (isStale(*pp, now) || strcmp((*pp)->key, e->key)==0) {
+			removeEntry(pInstance, pp);
+			continue;
+		}
+		if (victim==NULL || (int32_t)((*pp)->expires - (*victim)->expires)<0) victim=pp;
+		pp=&(*pp)->next;
+	}
+	if (pInstance->respCacheCount>=CONFIG_ESPHTTPD_RESPONSE_CACHE_ENTRIES && victim!=NULL) {
+		removeEntry(pInstance, victim);
+	}
+	e->next=pInstance->respCache;
+	pInstance->respCache=e;
+	pInstance->respCacheCount++;
+}
+
+void ICACHE_FLASH_ATTR httpdCacheRelease(HttpdCacheEntry *e) {
+	if (--e->refs>0) return;
+	free(e->data);
+	free(e);
+}
+
+void ICACHE_FLASH_ATTR httpdCacheInvalidate(HttpdInstance *pInstance, const char *route) {
+	HttpdCacheEntry **pp;
+	httpdPlatLock(pInstance);
+	pp=&pInstance->respCache;
+	while (*pp!=NULL) {
+		if (route==NULL || strcmp((*pp)->route, route)==0) {
+			removeEntry(pInstance, pp);
+		} else {
+			pp=&(*pp)->next;
+		}
+	}
+	httpdPlatUnlock(pInstance);
+}
+#endif // CONFIG_ESPHTTPD_RESPONSE_CACHE
@@ -0,0 +1,64 @@
+#ifndef HTTPD_CACHE_H
+#define HTTPD_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libesphttpd/httpd.h"
+
+//Longest url plus GET arguments a response is cached for.
+#ifndef HTTPD_CACHE_KEY_LEN
+#define HTTPD_CACHE_KEY_LEN 192
+#endif
+
+typedef struct HttpdCacheEntry HttpdCacheEntry;
+
+//A response as the cgi made it: the header lines it added, and the body. What the server adds
+//itself (status line, framing, compression) is redone for every client it's sent to.
+struct HttpdCacheEntry {
+	HttpdCacheEntry *next;
+	int refs;				// One for the cache, one per response being sent from it
+	const char *route;		// Route it was made for, see httpdCacheInvalidate()
+	uint32_t expires;		// httpdPlatGetTimeMs() it goes stale at
+	int code;
+	int flags;				// Flags of the original response that matter for sending it again
+	int hdrLen;				// data starts with the header lines, the body follows
+	int len;
+	int size;
+	char *data;
+	char key[];				// url, and the GET arguments in sorted order
+};
+
+/**
+ * Builds the key of a request: the url plus its GET arguments in sorted order, so the order
+ * the client sends them in doesn't matter.
+ * @return false if it doesn't fit in len bytes
+ */
+bool httpdCacheMakeKey(const char *url, const char *getArgs, char *key, int len);
+
+/**
+ * @return the fresh entry for the key with a reference taken, or NULL
+ */
+HttpdCacheEntry *httpdCacheGet(HttpdInstance *pInstance, const char *key);
+
+/**
+ * Starts an entry for a response that's about to be made; it isn't in the cache until
+ * httpdCachePut().
+ */
+HttpdCacheEntry *httpdCacheNew(const char *route, const char *key, int ttlMs);
+
+/**
+ * @return false if the entry grew over CONFIG_ESPHTTPD_RESPONSE_CACHE_MAX_LEN or out of memory;
+ * it should be dropped then
+ */
+bool httpdCacheAppend(HttpdCacheEntry *e, const char *data, int len);
+
+/**
+ * Adds a finished entry to the cache, replacing an older one for the same key and evicting
+ * the one closest to going stale if the cache is full. Takes over the reference of the caller.
+ */
+void httpdCachePut(HttpdInstance *pInstance, HttpdCacheEntry *e);
+
+void httpdCacheRelease(HttpdCacheEntry *e);
+
+#endif
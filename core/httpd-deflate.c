@@ -0,0 +1,89 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Streaming gzip/deflate compression of response bodies, on top of zlib. The memory used per
+stream is set by the window bits and memory level: about 2^(windowBits+2) + 2^(memLevel+9)
+bytes plus zlib's fixed ~6k. The defaults below are for Linux, on the esp32 they come from
+menuconfig and are a lot smaller.
+*/
+
+#ifdef linux
+#include <libesphttpd/linux.h>
+#else
+#include <libesphttpd/esp.h>
+#endif
+
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+#include <zlib.h>
+
+#include "httpd-deflate.h"
+#include "esp_log.h"
+
+const static char* TAG = "httpd-deflate";
+
+#ifndef CONFIG_ESPHTTPD_DEFLATE_LEVEL
+#define CONFIG_ESPHTTPD_DEFLATE_LEVEL 6
+#endif
+
+#ifndef CONFIG_ESPHTTPD_DEFLATE_WINDOW_BITS
+#define CONFIG_ESPHTTPD_DEFLATE_WINDOW_BITS 15
+#endif
+
+#ifndef CONFIG_ESPHTTPD_DEFLATE_MEM_LEVEL
+#define CONFIG_ESPHTTPD_DEFLATE_MEM_LEVEL 8
+#endif
+
+//Size of the buffer compressed output is collected in before it's handed on.
+#ifndef HTTPD_DEFLATE_OUT_LEN
+#define HTTPD_DEFLATE_OUT_LEN 1024
+#endif
+
+struct HttpdDeflate {
+	z_stream zs;
+	char buff[HTTPD_DEFLATE_HEADROOM+HTTPD_DEFLATE_OUT_LEN+HTTPD_DEFLATE_TAILROOM];
+};
+
+HttpdDeflate ICACHE_FLASH_ATTR *httpdDeflateNew(bool gzip) {
+	int r;
+	HttpdDeflate *d=calloc(1, sizeof(HttpdDeflate));
+	if (d==NULL) return NULL;
+	//zlib takes 16 added to the window bits as the request for a gzip wrapper
+	r=deflateInit2(&d->zs, CONFIG_ESPHTTPD_DEFLATE_LEVEL, Z_DEFLATED,
+			CONFIG_ESPHTTPD_DEFLATE_WINDOW_BITS+(gzip?16:0), CONFIG_ESPHTTPD_DEFLATE_MEM_LEVEL,
+			Z_DEFAULT_STRATEGY);
+	if (r!=Z_OK) {
+		ESP_LOGE(TAG, "deflateInit2 failed: %d", r);
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+bool ICACHE_FLASH_ATTR httpdDeflateData(HttpdDeflate *d, const char *data, int len, bool finish, HttpdDeflateOutCb cb, void *arg) {
+	char *out=d->buff+HTTPD_DEFLATE_HEADROOM;
+	int r, outLen;
+
+	d->zs.next_in=(Bytef *)data;
+	d->zs.avail_in=len;
+	do {
+		d->zs.next_out=(Bytef *)out;
+		d->zs.avail_out=HTTPD_DEFLATE_OUT_LEN;
+		r=deflate(&d->zs, finish?Z_FINISH:Z_NO_FLUSH);
+		if (r==Z_STREAM_ERROR) {
+			ESP_LOGE(TAG, "deflate failed");
+			return false;
+		}
+		outLen=HTTPD_DEFLATE_OUT_LEN-d->zs.avail_out;
+		if (outLen>0 || r==Z_STREAM_END) cb(arg, out, outLen, r==Z_STREAM_END);
+		//A full output buffer means zlib may have more; when finishing, go on until it's all out.
+	} while (d->zs.avail_out==0 || (finish && r!=Z_STREAM_END));
+	return true;
+}
+
+void ICACHE_FLASH_ATTR httpdDeflateFree(HttpdDeflate *d) {
+	deflateEnd(&d->zs);
+	free(d);
+}
+#endif // CONFIG_ESPHTTPD_DEFLATE_SUPPORT
@@ -0,0 +1,34 @@
+#ifndef HTTPD_DEFLATE_H
+#define HTTPD_DEFLATE_H
+
+#include <stdbool.h>
+
+//Room the output callback may use in front of and behind every piece of output it is handed,
+//for the framing of the piece. Enough for a chunk size line, and a chunk end plus the last chunk.
+#define HTTPD_DEFLATE_HEADROOM 10
+#define HTTPD_DEFLATE_TAILROOM 7
+
+typedef struct HttpdDeflate HttpdDeflate;
+
+/**
+ * Called with every piece of compressed output. last is set on the final call for the stream,
+ * which may come with len 0.
+ */
+typedef void (*HttpdDeflateOutCb)(void *arg, char *data, int len, bool last);
+
+/**
+ * Starts a compressed stream, with a gzip wrapper or a zlib (http 'deflate') one.
+ * @return NULL if out of memory
+ */
+HttpdDeflate *httpdDeflateNew(bool gzip);
+
+/**
+ * Compresses len bytes of data, handing whatever output is ready to cb. Output is held back
+ * until there's a full buffer of it, unless finish is set; that ends the stream.
+ * @return false on a zlib error
+ */
+bool httpdDeflateData(HttpdDeflate *d, const char *data, int len, bool finish, HttpdDeflateOutCb cb, void *arg);
+
+void httpdDeflateFree(HttpdDeflate *d);
+
+#endif
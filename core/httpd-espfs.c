@@ -16,63 +16,144 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 
 #ifdef CONFIG_ESPHTTPD_USE_ESPFS
 #include "libespfs/espfs.h"
+#include "httpd-platform.h"
 #include "esp_log.h"
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+#include "httpd-gunzip.h"
+#endif
 const static char* TAG = "httpdespfs";
 
 #define FILE_CHUNK_LEN    1024
 
+// Longest template token, including its html:/js: prefix
+#define TPL_TOKEN_LEN    64
+
+#ifndef CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES
+#define CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES 4
+#endif
+
 // The static files marked with ESPFS_FLAG_GZIP are compressed and will be served with GZIP compression.
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
 static espfs_fs_t *espfs = NULL;
 
+// What's known of request paths, cached since the image doesn't change, including paths that
+// lead nowhere. Besides the HTTPD_ENC_BIT()s of the variants found, VARIANT_GZIP_FLAGGED marks
+// a plain file that espfs stores gzipped, VARIANT_DIR a directory, and the VARIANT_INDEX bits
+// hold which of indexNames the variants are of, plus one, if it's the index of the path.
+// Shared by all server instances, so only touched with httpdPlatSharedLock() held.
+#define VARIANT_ENC_MASK (HTTPD_ENC_BIT(HTTPD_ENC_COUNT) - 1)
+#define VARIANT_INDEX_SHIFT 3
+#define VARIANT_INDEX_MASK (7<<VARIANT_INDEX_SHIFT)
+#define VARIANT_DIR (1<<6)
+#define VARIANT_GZIP_FLAGGED (1<<7)
+static HttpdVariantCacheEntry variantCache[HTTPD_VARIANT_CACHE_SIZE];
+
+// Content hashes of files mapped from the image, by index in the image plus one, so a file is
+// hashed once for its entity tag. Shared by all server instances, like variantCache.
+typedef struct {
+	uint32_t index;
+	uint32_t hash;
+} EtagCacheEntry;
+static EtagCacheEntry etagCache[HTTPD_VARIANT_CACHE_SIZE];
+
+static const char *const indexNames[] = {"index.html", "index.htm", "index.tpl.html", "index.tpl"};
+#define INDEX_NAMES (sizeof(indexNames) / sizeof(indexNames[0]))
+
+static void tplCacheClear(void);
+
+// Called before any server is started, so the caches aren't locked here.
 void httpdRegisterEspfs(espfs_fs_t *fs) {
 	espfs = fs;
+	memset(variantCache, 0, sizeof(variantCache));
+	memset(etagCache, 0, sizeof(etagCache));
+	tplCacheClear();
 }
 
 /**
- * Try to open a file
- * @param path - path to the file, may end with slash
- * @param indexname - filename at the path
- * @return file pointer or NULL
+ * Find out what a path is in the image, uncached: which variants of it there are (path.br,
+ * path.gz and path itself), and whether it's a directory
  */
-static espfs_file_t *tryOpenIndex_do(const char *path, const char *indexname) {
-	char fname[100];
-	espfs_file_t *retval;
-	size_t url_len = strlen(path);
-	size_t index_len = strlen(indexname);
-	bool needSlash = false;
+static uint8_t statVariants(const char *path) {
+	char fname[256];
+	espfs_stat_t s;
+	uint8_t variants = 0;
+	HttpdEncoding enc;
 
-	// will we need to append a slash?
-	if((url_len > 0) && (path[url_len - 1] != '/')) {
-		url_len++;
-		needSlash = true;
+	for (enc = 0; enc < HTTPD_ENC_COUNT; enc++) {
+		if (snprintf(fname, sizeof(fname), "%s%s", path, httpdEncodingSuffix(enc)) >= sizeof(fname)) {
+			continue;
+		}
+		if (!espfs_stat(espfs, fname, &s)) continue;
+		if (s.type == ESPFS_TYPE_FILE) {
+			variants |= HTTPD_ENC_BIT(enc);
+			if (enc == HTTPD_ENC_IDENTITY && (s.flags & ESPFS_FLAG_GZIP)) {
+				variants |= VARIANT_GZIP_FLAGGED;
+			}
+		} else if (s.type == ESPFS_TYPE_DIR && enc == HTTPD_ENC_IDENTITY) {
+			variants |= VARIANT_DIR;
+		}
 	}
+	return variants;
+}
 
-	// do we have enough space to handle the input strings
-	// -1 to leave space for a trailing null
-	if((url_len + index_len) >= (sizeof(fname) - 1))
-	{
-		retval = NULL;
-		ESP_LOGE(TAG, "fname too small");
-	} else
-	{
-		strcpy(fname, path);
-
-		// Append slash if missing
-		if(needSlash)
-		{
-			strcat(fname, "/");
+/**
+ * Resolve a request path to the file it's served from: the path itself if there's a variant
+ * of it, otherwise its index file if it has one. Answered from the cache after the first time,
+ * also when there's neither.
+ * @param fname - gets the path of the file, may be NULL
+ * @return the variant bits of the file, VARIANT_INDEX bits set if it's an index file; no
+ * VARIANT_ENC_MASK bits if nothing was found
+ */
+static uint8_t resolvePath(const char *path, char *fname, size_t len) {
+	char iname[256];
+	size_t url_len = strlen(path);
+	const char *slash = ((url_len > 0) && (path[url_len - 1] != '/')) ? "/" : "";
+	uint8_t variants, v;
+	unsigned int i;
+	bool cached;
+
+	httpdPlatSharedLock();
+	cached = httpdVariantCacheGet(variantCache, HTTPD_VARIANT_CACHE_SIZE, path, &variants);
+	httpdPlatSharedUnlock();
+	if (!cached) {
+		variants = statVariants(path);
+		// A dot in the filename probably means extension
+		// no point in trying to look for index.
+		if (!(variants & VARIANT_ENC_MASK) && strchr(path, '.') == NULL) {
+			for (i = 0; i < INDEX_NAMES; i++) {
+				if (snprintf(iname, sizeof(iname), "%s%s%s", path, slash, indexNames[i]) >= sizeof(iname)) {
+					ESP_LOGE(TAG, "fname too small");
+					break;
+				}
+				v = statVariants(iname);
+				if (v & VARIANT_ENC_MASK) {
+					variants = (variants & VARIANT_DIR) | v | ((i + 1) << VARIANT_INDEX_SHIFT);
+					break;
+				}
+			}
+		}
+		httpdPlatSharedLock();
+		httpdVariantCachePut(variantCache, HTTPD_VARIANT_CACHE_SIZE, path, variants);
+		httpdPlatSharedUnlock();
+	}
+	if (fname != NULL) {
+		i = (variants & VARIANT_INDEX_MASK) >> VARIANT_INDEX_SHIFT;
+		if (snprintf(fname, len, "%s%s%s", path, i ? slash : "", i ? indexNames[i - 1] : "") >= len) {
+			ESP_LOGE(TAG, "fname too small");
+			return 0;
 		}
-
-		strcat(fname, indexname);
-
-		// Try to open, returns NULL if failed
-		retval = espfs_fopen(espfs, fname);
 	}
+	return variants;
+}
 
-	return retval;
+/**
+ * @return whether the path is a file of its own in the image, not a directory or missing
+ */
+static bool isPlainFile(const char *path) {
+	uint8_t variants = resolvePath(path, NULL, 0);
+	return (variants & HTTPD_ENC_BIT(HTTPD_ENC_IDENTITY)) && !(variants & VARIANT_INDEX_MASK);
 }
 
 /**
@@ -81,58 +162,135 @@ static espfs_file_t *tryOpenIndex_do(const char *path, const char *indexname) {
  * @return file pointer or NULL
  */
 espfs_file_t *tryOpenIndex(const char *path) {
-	espfs_file_t * file;
-	// A dot in the filename probably means extension
-	// no point in trying to look for index.
-	if (strchr(path, '.') != NULL) return NULL;
+	char fname[256];
+	uint8_t variants = resolvePath(path, fname, sizeof(fname));
+
+	if (!(variants & VARIANT_INDEX_MASK) || !(variants & HTTPD_ENC_BIT(HTTPD_ENC_IDENTITY))) {
+		return NULL;
+	}
+	return espfs_fopen(espfs, fname);
+}
 
-	file = tryOpenIndex_do(path, "index.html");
-	if (file != NULL) return file;
+/**
+ * Build a strong entity tag for a file in the espfs image
+ *
+ * The tag is derived from a hash of the file contents and its size, so it stays the same
+ * across restarts and wherever the image is mapped, and changes whenever a reflashed image
+ * changes the file. Files that can't be mapped directly (e.g. heatshrink compressed) fall
+ * back to their index in the image. The suffix tells apart other representations made of
+ * the same file.
+ */
+static void makeEtag(espfs_file_t *file, const espfs_stat_t *s, const char *suffix, char *etag, size_t len)
+{
+	void *data = NULL;
+	ssize_t size = espfs_access(file, &data);
+	EtagCacheEntry *e = &etagCache[s->index % HTTPD_VARIANT_CACHE_SIZE];
+	uint32_t tag = s->index;
+	bool cached = false;
+	const uint8_t *p;
+
+	if (size >= 0 && data != NULL) {
+		httpdPlatSharedLock();
+		if (e->index == s->index + 1u) {
+			tag = e->hash;
+			cached = true;
+		}
+		httpdPlatSharedUnlock();
+		if (!cached) {
+			// FNV-1a, like httpdPathHash()
+			tag = 2166136261u;
+			for (p = data; p < (const uint8_t *)data + size; p++) {
+				tag ^= *p;
+				tag *= 16777619u;
+			}
+			httpdPlatSharedLock();
+			e->index = s->index + 1u;
+			e->hash = tag;
+			httpdPlatSharedUnlock();
+		}
+	}
+	snprintf(etag, len, "\"%x-%x%s\"", (unsigned int)tag, (unsigned int)s->size, suffix);
+}
+
+typedef struct {
+	espfs_file_t *file;
+	size_t remaining;	// bytes of the response body still to be sent
+	const char *data;	// the rest of the body in the mapped image, NULL if it's read from the file
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+	HttpdGunzip *gunzip;	// decompresses the file, if the client can't take it gzipped
+#endif
+} StaticFileState;
 
-	file = tryOpenIndex_do(path, "index.htm");
-	if (file != NULL) return file;
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+static int gunzipRead(void *arg, char *buf, int len)
+{
+	return espfs_fread((espfs_file_t *)arg, buf, len);
+}
+#endif
 
-	file = tryOpenIndex_do(path, "index.tpl.html");
-	if (file != NULL) return file;
+// Releases what serveStaticFile() holds for a response.
+static void freeStaticFileState(StaticFileState *state)
+{
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+	if (state->gunzip != NULL) {
+		httpdGunzipFree(state->gunzip);
+	}
+#endif
+	espfs_fclose(state->file);
+	free(state);
+}
 
-	file = tryOpenIndex_do(path, "index.tpl");
-	if (file != NULL) return file;
+static int staticFileRead(void *ctx, char *buf, int len)
+{
+	StaticFileState *state = (StaticFileState *)ctx;
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+	if (state->gunzip != NULL) {
+		return httpdGunzipRead(state->gunzip, buf, len);
+	}
+#endif
+	return espfs_fread(state->file, buf, len);
+}
 
-	return NULL; // failed to guess the right name
+static void staticFileClose(void *ctx)
+{
+	freeStaticFileState((StaticFileState *)ctx);
 }
 
+static const HttpdStreamOps staticFileStreamOps = {
+	.read = staticFileRead,
+	.close = staticFileClose,
+};
+
 CgiStatus ICACHE_FLASH_ATTR
 serveStaticFile(HttpdConnData *connData, const char* filepath) {
-	espfs_file_t *file=connData->cgiData;
+	StaticFileState *state=connData->cgiData;
+	espfs_file_t *file;
 	int len;
-	char buff[FILE_CHUNK_LEN+1];
-	char acceptEncodingBuffer[64];
-	int isGzip;
+	char buff[64];
 
 	if (connData->isConnectionClosed) {
 		//Connection closed. Clean up.
-		espfs_fclose(file);
+		if (state != NULL) {
+			freeStaticFileState(state);
+		}
 		return HTTPD_CGI_DONE;
 	}
 
 	//First call to this cgi.
-	if (file==NULL) {
+	if (state==NULL) {
 		// invalid call.
 		if (filepath == NULL) {
 			ESP_LOGE(TAG, "serveStaticFile called with NULL path");
 			return HTTPD_CGI_NOTFOUND;
 		}
 
-		//First call to this cgi. Open the file so we can read it.
-		file = espfs_fopen(espfs, filepath);
-		if (file == NULL) {
-			// file not found
-
-			// If this is a folder, look for index file
-			file = tryOpenIndex(filepath);
-			if (file == NULL) return HTTPD_CGI_NOTFOUND;
+		//First call to this cgi. Find out which variants of the file there are.
+		char fname[256];
+		uint8_t variants = resolvePath(filepath, fname, sizeof(fname));
+		if (!(variants & VARIANT_ENC_MASK)) return HTTPD_CGI_NOTFOUND;
 
-			// A file was found by tryOpenIndex, but we should require a 
+		if (variants & VARIANT_INDEX_MASK) {
+			// The path is a folder with an index file, but we should require a 
 			//   trailing slash so clients can properly resolve relative paths. 
 			//   I.e. "GET /hello" should redirect to "/hello/"
 			//   because /hello/index.html might require "./app.js", 
@@ -141,10 +299,6 @@ serveStaticFile(HttpdConnData *connData, const char* filepath) {
 			//   I.e. "GET myapp.com" can serve "/index.html"
 			size_t url_len = strlen(filepath);
 			if((url_len > 0) && (filepath[url_len - 1] != '/')) {
-				espfs_fclose(file); // not serving the file this time
-				const size_t fnameBufSize = 100;
-				char fname[fnameBufSize];
-
 				// do we have enough space to add a trailing '/'?
 				// -1 to leave space for a trailing null
 				if((url_len + 1) >= (sizeof(fname) - 1))
@@ -160,29 +314,106 @@ serveStaticFile(HttpdConnData *connData, const char* filepath) {
 			}
 		}
 
-		// The gzip checking code is intentionally without #ifdefs because checking
-		// for ESPFS_FLAG_GZIP (which indicates gzip compressed file) is very easy, doesn't
-		// mean additional overhead and is actually safer to be on at all times.
-		// If there are no gzipped files in the image, the code bellow will not cause any harm.
-
-		// Check if requested file was GZIP compressed
+		// Pick the variant the client likes best. A plain file that espfs stores
+		// gzipped (ESPFS_FLAG_GZIP) can only be sent as gzip; the gzip checking is
+		// intentionally without #ifdefs, as it costs next to nothing and is safer
+		// to have on at all times.
+		unsigned int available = variants & VARIANT_ENC_MASK;
+		if (variants & VARIANT_GZIP_FLAGGED) {
+			available = (available & ~HTTPD_ENC_BIT(HTTPD_ENC_IDENTITY)) | HTTPD_ENC_BIT(HTTPD_ENC_GZIP);
+		}
+		HttpdEncoding enc = httpdNegotiateEncoding(connData, available);
+		bool gunzip = false;
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+		// A client that doesn't take gzip can still get the gzip variant, decompressed
+		// while it's sent.
+		if (enc == HTTPD_ENC_COUNT && (available & HTTPD_ENC_BIT(HTTPD_ENC_GZIP)) &&
+				httpdGetEncodingQ(connData, "identity") > 0) {
+			enc = HTTPD_ENC_GZIP;
+			gunzip = true;
+		}
+#endif
+		if (enc == HTTPD_ENC_COUNT) {
+			// The client takes none of the encodings the file is stored in (telnet users for e.g.)
+			httpdSend(connData, gzipNonSupportedMessage, -1);
+			return HTTPD_CGI_DONE;
+		}
+		// A gzip sibling is only opened if it exists, otherwise it's the flagged file itself
+		if (enc != HTTPD_ENC_GZIP || (variants & HTTPD_ENC_BIT(HTTPD_ENC_GZIP))) {
+			strlcat(fname, httpdEncodingSuffix(enc), sizeof(fname));
+		}
+		file = espfs_fopen(espfs, fname);
+		if (file == NULL) return HTTPD_CGI_NOTFOUND;
 		espfs_stat_t s = {0};
 		espfs_fstat(file, &s);
-		isGzip = s.flags & ESPFS_FLAG_GZIP;
-		if (isGzip) {
-			// Check the browser's "Accept-Encoding" header. If the client does not
-			// advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-			bool found = httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, sizeof(acceptEncodingBuffer));
-			if (!found || (strstr(acceptEncodingBuffer, "gzip") == NULL)) {
-				//No Accept-Encoding: gzip header present
-				httpdSend(connData, gzipNonSupportedMessage, -1);
+
+		// If the client already has this version of the file, answer with a
+		// 304 Not Modified without reading any of it.
+		char etag[32];
+		makeEtag(file, &s, gunzip ? "-gunzip" : "", etag, sizeof(etag));
+		bool notModified = httpdEtagMatches(connData, etag);
+
+		// Only files stored uncompressed in the image can be seeked into cheaply,
+		// so those are the only ones we serve byte ranges of. Not when decompressing
+		// them though, the offsets would be into the compressed data.
+		bool seekable = (s.compression == 0) && !gunzip;
+		long start = 0, end = (long)s.size - 1;
+		HttpdRangeResult range = HTTPD_RANGE_NONE;
+		if (!notModified && seekable) {
+			range = httpdGetRange(connData, s.size, etag, &start, &end);
+		}
+
+		if (range == HTTPD_RANGE_UNSATISFIABLE) {
+			snprintf(buff, sizeof(buff), "bytes */%u", (unsigned int)s.size);
+			httpdSetContentLength(connData, 0);
+			httpdStartResponse(connData, 416);
+			httpdHeader(connData, "Content-Range", buff);
+			httpdEndHeaders(connData);
+			espfs_fclose(file);
+			return HTTPD_CGI_DONE;
+		}
+
+		if (range == HTTPD_RANGE_OK && espfs_fseek(file, start, SEEK_SET) < 0) {
+			ESP_LOGE(TAG, "seek to %ld failed, sending whole file", start);
+			range = HTTPD_RANGE_NONE;
+			start = 0;
+			end = (long)s.size - 1;
+		}
+
+		if (!notModified) {
+			state = malloc(sizeof(StaticFileState));
+			if (state == NULL) {
+				ESP_LOGE(TAG, "Can't allocate static file state");
 				espfs_fclose(file);
-				return HTTPD_CGI_DONE;
+				return HTTPD_CGI_NOTFOUND;
+			}
+			state->file = file;
+			state->remaining = end - start + 1;
+			// Files stored as they're sent can go out straight from the image
+			void *mapped = NULL;
+			state->data = NULL;
+			if (seekable && espfs_access(file, &mapped) >= 0 && mapped != NULL) {
+				state->data = (const char *)mapped + start;
+			}
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+			state->gunzip = NULL;
+			if (gunzip) {
+				state->gunzip = httpdGunzipNew(gunzipRead, file);
+				if (state->gunzip == NULL) {
+					// Too many files being decompressed already
+					freeStaticFileState(state);
+					httpdSend(connData, gzipNonSupportedMessage, -1);
+					return HTTPD_CGI_DONE;
+				}
+			}
+#endif
+			connData->cgiData = state;
+			// The decompressed length isn't known up front, that body goes out chunked
+			if (!gunzip) {
+				httpdSetContentLength(connData, state->remaining);
 			}
 		}
-
-		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
+		httpdStartResponse(connData, notModified ? 304 : ((range == HTTPD_RANGE_OK) ? 206 : 200));
 
 		const char *mimetype = NULL;
 		bool sendContentType = false;
@@ -200,15 +431,26 @@ serveStaticFile(HttpdConnData *connData, const char* filepath) {
 			sendContentType = true;
 		}
 
-		if (sendContentType) {
+		if (sendContentType && !notModified) {
 			if (!mimetype) {
 				mimetype = httpdGetMimetype(connData->url);
 			}
 			httpdHeader(connData, "Content-Type", mimetype);
 		}
 
-		if (isGzip) {
-			httpdHeader(connData, "Content-Encoding", "gzip");
+		if (enc != HTTPD_ENC_IDENTITY && !gunzip && !notModified) {
+			httpdHeader(connData, "Content-Encoding", httpdEncodingName(enc));
+		}
+		// What's sent depends on the client's Accept-Encoding if there's a compressed variant
+		if (available != HTTPD_ENC_BIT(HTTPD_ENC_IDENTITY)) {
+			httpdHeader(connData, "Vary", "Accept-Encoding");
+		}
+
+		httpdHeader(connData, "ETag", etag);
+		httpdHeader(connData, "Accept-Ranges", seekable ? "bytes" : "none");
+		if (range == HTTPD_RANGE_OK) {
+			snprintf(buff, sizeof(buff), "bytes %ld-%ld/%u", start, end, (unsigned int)s.size);
+			httpdHeader(connData, "Content-Range", buff);
 		}
 
 		if (connData->cgiArg == &httpdCgiEx) {
@@ -223,25 +465,31 @@ serveStaticFile(HttpdConnData *connData, const char* filepath) {
 			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
 		}
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_MORE;
+		if (notModified) {
+			espfs_fclose(file);
+			return HTTPD_CGI_DONE;
+		}
+		if (state->data == NULL) {
+			// The server reads the rest as the connection takes it
+			connData->cgiData = NULL;
+			return httpdServeStream(connData, &staticFileStreamOps, state, gunzip ? -1 : (long)state->remaining);
+		}
 	}
 
-	len=espfs_fread(file, buff, FILE_CHUNK_LEN);
-	if (len>0) httpdSend(connData, buff, len);
-	if (len!=FILE_CHUNK_LEN) {
-		//We're done.
-		espfs_fclose(file);
-		return HTTPD_CGI_DONE;
-	} else {
-		//Ok, till next time.
-		return HTTPD_CGI_MORE;
-	}
+	// Sent by reference; this is called again once it's out. Nothing may be taken while
+	// something else is still pending, that's retried on the next call.
+	len = httpdSendRef(connData, state->data, state->remaining);
+	state->data += len;
+	state->remaining -= len;
+	if (state->remaining > 0 || len > 0) return HTTPD_CGI_MORE;
+	freeStaticFileState(state);
+	connData->cgiData = NULL;
+	return HTTPD_CGI_DONE;
 }
 
 
 static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
 {
-	espfs_stat_t s;
 	int outlen;
 	if (!espfs)
 	{
@@ -252,7 +500,7 @@ static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
 		filepath[0] = '\0';
 		if (connData->cgiArg != NULL) {
 			outlen = strlcpy(filepath, connData->cgiArg, len);
-			if (espfs_stat(espfs, filepath, &s) == 0 && s.type == ESPFS_TYPE_FILE) {
+			if (isPlainFile(filepath)) {
 				return outlen;
 			}
 		}
@@ -280,7 +528,7 @@ static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
 	}
 
 	outlen = strlcpy(filepath, ex->basepath, len);
-	if (!espfs_stat(espfs, ex->basepath, &s) || s.type == ESPFS_TYPE_DIR) {
+	if (!isPlainFile(ex->basepath)) {
 		if (ex->basepath[basepathLen - 1] != '/') {
 			strlcat(filepath, "/", len);
 		}
@@ -312,20 +560,239 @@ typedef enum {
 	ENCODE_JS,
 } TplEncode;
 
+// A template compiled into the list of things to send: runs of text, sent as they are, and
+// tokens, replaced by what the callback sends. Text is referred to where it lies in the template,
+// which is mapped from the image where possible, so requests don't parse or copy it again.
+typedef enum {
+	TPL_OP_TEXT = 0,
+	TPL_OP_TOKEN,
+} TplOpType;
+
+typedef struct {
+	uint32_t ofs;		// where the text, or the token name without its prefix, starts
+	uint32_t len;
+	uint8_t type;		// TplOpType
+	uint8_t encode;		// TplEncode of a token
+} TplOp;
+
 typedef struct {
+	int refs;		// one for the cache, one per response being sent from it
+	uint32_t lastUsed;
+	const char *data;	// template text
+	bool ownsData;		// data is a heap copy, not mapped from the image
+	int opCount;
+	TplOp *ops;
+	char path[];		// path it was requested by
+} TplCompiled;
+
+// Shared by all server instances, like variantCache.
+static TplCompiled *tplCache[CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES];
+static uint32_t tplCacheClock = 0;
+
+static void tplRelease(TplCompiled *tpl)
+{
+	if (--tpl->refs > 0) return;
+	if (tpl->ownsData) {
+		free((char *)tpl->data);
+	}
+	free(tpl->ops);
+	free(tpl);
+}
+
+// Forgets the compiled templates, e.g. because they're of another image.
+static void tplCacheClear(void)
+{
+	for (int i = 0; i < CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES; i++) {
+		if (tplCache[i] != NULL) {
+			tplRelease(tplCache[i]);
+			tplCache[i] = NULL;
+		}
+	}
+}
+
+static bool tplAddOp(TplCompiled *tpl, int *size, TplOpType type, uint32_t ofs, uint32_t len, TplEncode encode)
+{
+	TplOp *op;
+	if (len == 0 && type == TPL_OP_TEXT) return true;
+	// Text that follows text, like the % of a %% escape, goes in the same op
+	if (type == TPL_OP_TEXT && tpl->opCount > 0) {
+		op = &tpl->ops[tpl->opCount - 1];
+		if (op->type == TPL_OP_TEXT && op->ofs + op->len == ofs) {
+			op->len += len;
+			return true;
+		}
+	}
+	if (tpl->opCount == *size) {
+		*size = *size ? *size * 2 : 8;
+		op = realloc(tpl->ops, *size * sizeof(TplOp));
+		if (op == NULL) return false;
+		tpl->ops = op;
+	}
+	op = &tpl->ops[tpl->opCount++];
+	op->ofs = ofs;
+	op->len = len;
+	op->type = type;
+	op->encode = encode;
+	return true;
+}
+
+static bool tplIsTokenChar(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '.' || c == '_' || c == '-' || c == ':';
+}
+
+// Splits the template text into ops. A %token% becomes a token op; %% is a single %, and
+// anything else starting with a % that isn't a valid token is left in the text as it is.
+static bool tplParse(TplCompiled *tpl, size_t len)
+{
+	static const struct {
+		const char *prefix;
+		TplEncode encode;
+	} prefixes[] = {
+		{"html:", ENCODE_HTML}, {"h:", ENCODE_HTML}, {"js:", ENCODE_JS}, {"j:", ENCODE_JS},
+	};
+	const char *d = tpl->data;
+	int size = 0;
+	size_t x, y, start = 0, tokLen, ofs;
+	TplEncode encode;
+	int i;
+
+	for (x = 0; x < len; x++) {
+		if (d[x] != '%') continue;
+		for (y = x + 1; y < len && y - x - 1 < TPL_TOKEN_LEN - 1 && tplIsTokenChar(d[y]); y++);
+		if (y == len) {
+			// A token the template ends in the middle of is dropped
+			len = x;
+			break;
+		}
+		if (d[y] != '%') {
+			// Not a token, it stays part of the text
+			x = y;
+			continue;
+		}
+		if (!tplAddOp(tpl, &size, TPL_OP_TEXT, start, x - start, ENCODE_PLAIN)) return false;
+		tokLen = y - x - 1;
+		if (tokLen == 0) {
+			if (!tplAddOp(tpl, &size, TPL_OP_TEXT, x, 1, ENCODE_PLAIN)) return false;
+		} else {
+			ofs = x + 1;
+			encode = ENCODE_PLAIN;
+			for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+				size_t l = strlen(prefixes[i].prefix);
+				if (tokLen >= l && strncmp(d + ofs, prefixes[i].prefix, l) == 0) {
+					ofs += l;
+					tokLen -= l;
+					encode = prefixes[i].encode;
+					break;
+				}
+			}
+			if (!tplAddOp(tpl, &size, TPL_OP_TOKEN, ofs, tokLen, encode)) return false;
+		}
+		start = y + 1;
+		x = y;
+	}
+	return tplAddOp(tpl, &size, TPL_OP_TEXT, start, len - start, ENCODE_PLAIN);
+}
+
+// Compiles the template a request path leads to, or NULL if there's none
+static TplCompiled *tplCompile(const char *path)
+{
+	char fname[256];
 	espfs_file_t *file;
-	void *tplArg;
-	char token[64];
-	int tokenPos;
+	espfs_stat_t s = {0};
+	void *data = NULL;
+	TplCompiled *tpl;
+
+	// The path itself, or the index file if it's a folder
+	if (!(resolvePath(path, fname, sizeof(fname)) & HTTPD_ENC_BIT(HTTPD_ENC_IDENTITY))) return NULL;
+	file = espfs_fopen(espfs, fname);
+	if (file == NULL) return NULL;
+	espfs_fstat(file, &s);
+	if (s.flags & ESPFS_FLAG_GZIP) {
+		ESP_LOGE(TAG, "cgiEspFsTemplate: Trying to use gzip-compressed file %s as template", path);
+		espfs_fclose(file);
+		return NULL;
+	}
+
+	tpl = calloc(1, sizeof(TplCompiled) + strlen(path) + 1);
+	if (tpl == NULL) {
+		espfs_fclose(file);
+		return NULL;
+	}
+	strcpy(tpl->path, path);
+	tpl->refs = 1;
+	if (espfs_access(file, &data) >= 0 && data != NULL) {
+		tpl->data = data;
+	} else {
+		// Compressed in the image, it's decompressed once and kept
+		tpl->data = malloc(s.size ? s.size : 1);
+		tpl->ownsData = true;
+		if (tpl->data == NULL || espfs_fread(file, (char *)tpl->data, s.size) != (ssize_t)s.size) {
+			ESP_LOGE(TAG, "Can't load template %s", path);
+			espfs_fclose(file);
+			tplRelease(tpl);
+			return NULL;
+		}
+	}
+	espfs_fclose(file);
 
-	char buff[FILE_CHUNK_LEN + 1];
+	if (!tplParse(tpl, s.size)) {
+		ESP_LOGE(TAG, "Can't allocate ops of template %s", path);
+		tplRelease(tpl);
+		return NULL;
+	}
+	ESP_LOGD(TAG, "Compiled template %s: %d ops", path, tpl->opCount);
+	return tpl;
+}
 
-	bool chunk_resume;
-	int buff_len;
-	int buff_x;
-	int buff_sp;
-	char *buff_e;
+// Returns the compiled template for a request path with a reference taken, compiling it
+// if it's not in the cache. Compiling is done once per template, with the shared lock held.
+static TplCompiled *tplGet(const char *path)
+{
+	int i, victim = 0;
+	TplCompiled *tpl;
+
+	httpdPlatSharedLock();
+	for (i = 0; i < CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES; i++) {
+		tpl = tplCache[i];
+		if (tpl != NULL && strcmp(tpl->path, path) == 0) {
+			tpl->lastUsed = ++tplCacheClock;
+			tpl->refs++;
+			httpdPlatSharedUnlock();
+			return tpl;
+		}
+		if (tplCache[victim] != NULL && (tpl == NULL || tpl->lastUsed < tplCache[victim]->lastUsed)) {
+			victim = i;
+		}
+	}
+	tpl = tplCompile(path);
+	if (tpl != NULL) {
+		if (tplCache[victim] != NULL) {
+			tplRelease(tplCache[victim]);
+		}
+		tpl->lastUsed = ++tplCacheClock;
+		tpl->refs++;
+		tplCache[victim] = tpl;
+	}
+	httpdPlatSharedUnlock();
+	return tpl;
+}
+
+// Drops the reference tplGet() took.
+static void tplPut(TplCompiled *tpl)
+{
+	httpdPlatSharedLock();
+	tplRelease(tpl);
+	httpdPlatSharedUnlock();
+}
 
+typedef struct {
+	TplCompiled *tpl;
+	void *tplArg;
+	int op;			// next op to send
+	uint32_t opOfs;		// how much of the text of that op is sent already
+	char token[TPL_TOKEN_LEN];
 	TplEncode tokEncode;
 } TplData;
 
@@ -343,54 +810,35 @@ tplSend(HttpdConnData *conn, const char *str, int len)
 
 CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 	TplData *tpd=connData->cgiData;
+	const TplOp *op;
+	int budget=FILE_CHUNK_LEN;
 	int len;
-	int x, sp=0;
-	char *e=NULL;
-	int tokOfs;
 
 	if (connData->isConnectionClosed) {
 		//Connection aborted. Clean up.
+		if (tpd == NULL) return HTTPD_CGI_DONE;
 		((TplCallback)(connData->cgiArg2))(connData, NULL, &tpd->tplArg);
-		espfs_fclose(tpd->file);
+		tplPut(tpd->tpl);
 		free(tpd);
 		return HTTPD_CGI_DONE;
 	}
 
 	if (tpd==NULL) {
-		//First call to this cgi. Open the file so we can read it.
-		tpd=(TplData *)malloc(sizeof(TplData));
+		//First call to this cgi. Get the compiled template.
+		tpd=(TplData *)calloc(1, sizeof(TplData));
 		if (tpd==NULL) {
 			ESP_LOGE(TAG, "Failed to malloc tpl struct");
 			return HTTPD_CGI_NOTFOUND;
 		}
 
-		tpd->chunk_resume = false;
-
 		char filepath[256];
 		getFilepath(connData, filepath, sizeof(filepath));
-		tpd->file = espfs_fopen(espfs, filepath);
-
-		if (tpd->file == NULL) {
-			// maybe a folder, look for index file
-			tpd->file = tryOpenIndex(filepath);
-			if (tpd->file == NULL) {
-				free(tpd);
-				return HTTPD_CGI_NOTFOUND;
-			}
-		}
-
-		tpd->tplArg=NULL;
-		tpd->tokenPos=-1;
-
-		espfs_stat_t s = {0};
-		espfs_fstat(tpd->file, &s);
-
-		if (s.flags & ESPFS_FLAG_GZIP) {
-			ESP_LOGE(TAG, "cgiEspFsTemplate: Trying to use gzip-compressed file %s as template", connData->url);
-			espfs_fclose(tpd->file);
+		tpd->tpl = tplGet(filepath);
+		if (tpd->tpl == NULL) {
 			free(tpd);
 			return HTTPD_CGI_NOTFOUND;
 		}
+
 		connData->cgiData=tpd;
 		httpdStartResponse(connData, 200);
 
@@ -433,141 +881,39 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 		return HTTPD_CGI_MORE;
 	}
 
-	char *buff = tpd->buff;
-
-	// resume the parser state from the last token,
-	// if subst. func wants more data to be sent.
-	if (tpd->chunk_resume) {
-		//espfs_dbg("Resuming tpl parser for multi-part subst");
-		len = tpd->buff_len;
-		e = tpd->buff_e;
-		sp = tpd->buff_sp;
-		x = tpd->buff_x;
-	} else {
-		len = espfs_fread(tpd->file, buff, FILE_CHUNK_LEN);
-		tpd->buff_len = len;
-
-		e = buff;
-		sp = 0;
-		x =  0;
-	}
-
-	if (len>0) {
-		for (; x<len; x++) {
-			if (tpd->tokenPos==-1) {
-				//Inside ordinary text.
-				if (buff[x]=='%') {
-					//Send raw data up to now
-					if (sp!=0) httpdSend(connData, e, sp);
-					sp=0;
-					//Go collect token chars.
-					tpd->tokenPos=0;
-				} else {
-					sp++;
-				}
-			} else {
-				if (buff[x]=='%') {
-					if (tpd->tokenPos==0) {
-						//This is the second % of a %% escape string.
-						//Send a single % and resume with the normal program flow.
-						httpdSend(connData, "%", 1);
-					} else {
-						if (!tpd->chunk_resume) {
-							//This is an actual token.
-							tpd->token[tpd->tokenPos++] = 0; //zero-terminate token
-
-							tokOfs = 0;
-							tpd->tokEncode = ENCODE_PLAIN;
-							if (strncmp(tpd->token, "html:", 5) == 0) {
-								tokOfs = 5;
-								tpd->tokEncode = ENCODE_HTML;
-							}
-							else if (strncmp(tpd->token, "h:", 2) == 0) {
-								tokOfs = 2;
-								tpd->tokEncode = ENCODE_HTML;
-							}
-							else if (strncmp(tpd->token, "js:", 3) == 0) {
-								tokOfs = 3;
-								tpd->tokEncode = ENCODE_JS;
-							}
-							else if (strncmp(tpd->token, "j:", 2) == 0) {
-								tokOfs = 2;
-								tpd->tokEncode = ENCODE_JS;
-							}
-
-							// do the shifting
-							if (tokOfs > 0) {
-								for(int i=tokOfs; i<=tpd->tokenPos; i++) {
-									tpd->token[i-tokOfs] = tpd->token[i];
-								}
-							}
-						}
-
-						tpd->chunk_resume = false;
-
-						CgiStatus status = ((TplCallback)(connData->cgiArg2))(connData, tpd->token, &tpd->tplArg);
-						if (status == HTTPD_CGI_MORE) {
-//							espfs_dbg("Multi-part tpl subst, saving parser state");
-							// wants to send more in this token's place.....
-							tpd->chunk_resume = true;
-							tpd->buff_len = len;
-							tpd->buff_e = e;
-							tpd->buff_sp = sp;
-							tpd->buff_x = x;
-							break;
-						}
-					}
-					//Go collect normal chars again.
-					e=&buff[x+1];
-					tpd->tokenPos=-1;
-				}
-				else {
-					// Add char to the token buf
-					char c = buff[x];
-					bool outOfSpace = tpd->tokenPos >= (sizeof(tpd->token) - 1);
-					if (outOfSpace ||
-						(   !(c >= 'a' && c <= 'z') &&
-							!(c >= 'A' && c <= 'Z') &&
-							!(c >= '0' && c <= '9') &&
-							c != '.' && c != '_' && c != '-' && c != ':'
-						)) {
-						// looks like we collected some garbage
-						httpdSend(connData, "%", 1);
-						if (tpd->tokenPos > 0) {
-							httpdSend(connData, tpd->token, tpd->tokenPos);
-						}
-						// the bad char
-						httpdSend(connData, &c, 1);
-
-						//Go collect normal chars again.
-						e=&buff[x+1];
-						tpd->tokenPos=-1;
-					}
-					else {
-						// collect it
-						tpd->token[tpd->tokenPos++] = c;
-					}
-				}
+	// Send about a chunk of text per call, plus whatever the tokens in it expand to.
+	while (tpd->op < tpd->tpl->opCount) {
+		op = &tpd->tpl->ops[tpd->op];
+		if (op->type == TPL_OP_TEXT) {
+			if (budget == 0) return HTTPD_CGI_MORE;
+			len = op->len - tpd->opOfs;
+			if (len > budget) len = budget;
+			// Token output or earlier text may have left less room than the budget
+			len = httpdSendPartial(connData, tpd->tpl->data + op->ofs + tpd->opOfs, len);
+			budget -= len;
+			tpd->opOfs += len;
+			if (tpd->opOfs < op->len) return HTTPD_CGI_MORE;
+		} else {
+			// The callback gets a copy, it's free to change it
+			memcpy(tpd->token, tpd->tpl->data + op->ofs, op->len);
+			tpd->token[op->len] = 0;
+			tpd->tokEncode = op->encode;
+			CgiStatus status = ((TplCallback)(connData->cgiArg2))(connData, tpd->token, &tpd->tplArg);
+			tpd->tokEncode = ENCODE_PLAIN;
+			if (status == HTTPD_CGI_MORE) {
+				// wants to send more in this token's place, it's called again next time
+				return HTTPD_CGI_MORE;
 			}
 		}
+		tpd->op++;
+		tpd->opOfs = 0;
 	}
 
-	if (tpd->chunk_resume) {
-		return HTTPD_CGI_MORE;
-	}
-
-	//Send remaining bit.
-	if (sp!=0) httpdSend(connData, e, sp);
-	if (len!=FILE_CHUNK_LEN) {
-		//We're done.
-		((TplCallback)(connData->cgiArg2))(connData, NULL, &tpd->tplArg);
-		ESP_LOGD(TAG, "Template sent");
-		espfs_fclose(tpd->file);
-		free(tpd);
-		return HTTPD_CGI_DONE;
-	} else {
-		//Ok, till next time.
-		return HTTPD_CGI_MORE;
-	}
+	//We're done.
+	((TplCallback)(connData->cgiArg2))(connData, NULL, &tpd->tplArg);
+	ESP_LOGD(TAG, "Template sent");
+	tplPut(tpd->tpl);
+	free(tpd);
+	return HTTPD_CGI_DONE;
 }
 #endif // CONFIG_ESPHTTPD_USE_ESPFS
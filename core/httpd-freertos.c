@@ -75,6 +75,48 @@ void httpdPlatDisableTimeout(HttpdConnData *pConn) {
     //Unimplemented for FreeRTOS
 }
 
+void ICACHE_FLASH_ATTR httpdPlatResume(HttpdInstance *pInstance, HttpdConnData *pConn) {
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+    char c = 0;
+    pRconn->needWriteDoneNotif=1; //the socket is most likely writable, so httpdSentCb follows right away
+    //One datagram wakes the select; more resumes before it's handled don't need another.
+    if (!pFR->wakePending && pFR->wakeFd >= 0) {
+        pFR->wakePending = true;
+        if (send(pFR->wakeFd, &c, 1, 0) != 1) {
+            ESP_LOGE(TAG, "wake send");
+            pFR->wakePending = false;
+        }
+    }
+}
+
+//Create the socket httpdPlatResume() wakes the select with: bound to an ephemeral loopback port
+//and connected to itself, so other tasks can send() to it without a socket of their own.
+static int ICACHE_FLASH_ATTR createWakeSocket(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "wake socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifndef linux
+    addr.sin_len = sizeof(addr);
+#endif
+    addr.sin_port = 0;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            getsockname(fd, (struct sockaddr *)&addr, &len) != 0 ||
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "wake socket setup");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 #ifdef linux
 //Set/clear global httpd lock.
 void ICACHE_FLASH_ATTR httpdPlatLock(HttpdInstance *pInstance) {
@@ -99,8 +141,51 @@ void ICACHE_FLASH_ATTR httpdPlatUnlock(HttpdInstance *pInstance) {
 }
 #endif
 
+#ifdef linux
+static pthread_mutex_t sharedMux;
+static pthread_once_t sharedMuxOnce = PTHREAD_ONCE_INIT;
+
+static void sharedMuxInit(void) {
+    pthread_mutexattr_t mutexattr;
+    pthread_mutexattr_init(&mutexattr);
+    pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sharedMux, &mutexattr);
+}
+
+void ICACHE_FLASH_ATTR httpdPlatSharedLock(void) {
+    pthread_once(&sharedMuxOnce, sharedMuxInit);
+    pthread_mutex_lock(&sharedMux);
+}
+
+void ICACHE_FLASH_ATTR httpdPlatSharedUnlock(void) {
+    pthread_mutex_unlock(&sharedMux);
+}
+#else
+//Created by the first httpdFreertosInitEx(), before any server task runs.
+static SemaphoreHandle_t sharedMux = NULL;
+
+void ICACHE_FLASH_ATTR httpdPlatSharedLock(void) {
+    xSemaphoreTakeRecursive(sharedMux, portMAX_DELAY);
+}
+
+void ICACHE_FLASH_ATTR httpdPlatSharedUnlock(void) {
+    xSemaphoreGiveRecursive(sharedMux);
+}
+#endif
+
 void closeConnection(HttpdFreertosInstance *pInstance, RtosConnType *rconn)
 {
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    //The cgi can't be told the connection is gone while a worker is still running it. Waiting
+    //for it would stall every other connection; it's closed once the worker hands it back.
+    httpdPlatLock(&pInstance->httpdInstance);
+    if (rconn->offloaded) {
+        rconn->needsClose=1;
+        httpdPlatUnlock(&pInstance->httpdInstance);
+        return;
+    }
+    httpdPlatUnlock(&pInstance->httpdInstance);
+#endif
     httpdDisconCb(&pInstance->httpdInstance, &rconn->connData);
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
@@ -201,6 +286,115 @@ static bool sslSetDerCertificateAndKey(HttpdFreertosInstance *pInstance,
 
 
 
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+#ifndef CONFIG_ESPHTTPD_OFFLOAD_WORKERS
+#define CONFIG_ESPHTTPD_OFFLOAD_WORKERS 1
+#endif
+
+#ifndef CONFIG_ESPHTTPD_OFFLOAD_STACK_SIZE
+#define CONFIG_ESPHTTPD_OFFLOAD_STACK_SIZE 4096
+#endif
+
+#ifdef ESP32
+#ifndef CONFIG_ESPHTTPD_PROC_CORE
+#define CONFIG_ESPHTTPD_PROC_CORE   tskNO_AFFINITY
+#endif
+#ifndef CONFIG_ESPHTTPD_PROC_PRI
+#define CONFIG_ESPHTTPD_PROC_PRI    4
+#endif
+#endif
+
+//Offloaded cgi calls waiting for a worker. There's at most one per connection.
+#ifndef HTTPD_OFFLOAD_QUEUE_LEN
+#define HTTPD_OFFLOAD_QUEUE_LEN 8
+#endif
+
+typedef struct {
+    HttpdInstance *pInstance;
+    HttpdConnData *conn;
+} OffloadJob;
+
+//The workers are shared by all server instances.
+#ifdef linux
+static pthread_mutex_t offloadMux = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offloadCond = PTHREAD_COND_INITIALIZER;
+static OffloadJob offloadQueue[HTTPD_OFFLOAD_QUEUE_LEN];
+static int offloadHead, offloadCount;
+#else
+static QueueHandle_t offloadQueue;
+#endif
+static bool offloadStarted;
+
+static PLAT_RETURN offloadWorkerTask(void *pvParameters) {
+    OffloadJob job;
+    while (1) {
+#ifdef linux
+        pthread_mutex_lock(&offloadMux);
+        while (offloadCount == 0) pthread_cond_wait(&offloadCond, &offloadMux);
+        job = offloadQueue[offloadHead];
+        offloadHead = (offloadHead + 1) % HTTPD_OFFLOAD_QUEUE_LEN;
+        offloadCount--;
+        pthread_mutex_unlock(&offloadMux);
+#else
+        xQueueReceive(offloadQueue, &job, portMAX_DELAY);
+#endif
+        httpdOffloadRun(job.pInstance, job.conn);
+    }
+    PLAT_TASK_EXIT;
+}
+
+static void ICACHE_FLASH_ATTR offloadStart(void) {
+    int i;
+    if (offloadStarted) return;
+    offloadStarted = true;
+#ifndef linux
+    offloadQueue = xQueueCreate(HTTPD_OFFLOAD_QUEUE_LEN, sizeof(OffloadJob));
+#endif
+    for (i = 0; i < CONFIG_ESPHTTPD_OFFLOAD_WORKERS; i++) {
+#ifdef linux
+        pthread_t thread;
+        pthread_create(&thread, NULL, offloadWorkerTask, NULL);
+#elif defined(ESP32)
+        xTaskCreatePinnedToCore(offloadWorkerTask, "httpd_worker", CONFIG_ESPHTTPD_OFFLOAD_STACK_SIZE, NULL, CONFIG_ESPHTTPD_PROC_PRI, NULL, CONFIG_ESPHTTPD_PROC_CORE);
+#else
+        xTaskCreate(offloadWorkerTask, (const signed char *)"httpd_worker", CONFIG_ESPHTTPD_OFFLOAD_STACK_SIZE, NULL, 4, NULL);
+#endif
+    }
+    ESP_LOGI(TAG, "%d offload workers started", CONFIG_ESPHTTPD_OFFLOAD_WORKERS);
+}
+
+bool ICACHE_FLASH_ATTR httpdPlatOffload(HttpdInstance *pInstance, HttpdConnData *pConn) {
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+    OffloadJob job = { pInstance, pConn };
+    bool queued;
+
+    //Set before queueing; the worker can't be done before we unlock the server anyway.
+    pRconn->offloaded = 1;
+#ifdef linux
+    pthread_mutex_lock(&offloadMux);
+    queued = (offloadCount < HTTPD_OFFLOAD_QUEUE_LEN);
+    if (queued) {
+        offloadQueue[(offloadHead + offloadCount) % HTTPD_OFFLOAD_QUEUE_LEN] = job;
+        offloadCount++;
+        pthread_cond_signal(&offloadCond);
+    }
+    pthread_mutex_unlock(&offloadMux);
+#else
+    queued = (offloadQueue != NULL && xQueueSend(offloadQueue, &job, 0) == pdTRUE);
+#endif
+    if (!queued) pRconn->offloaded = 0;
+    return queued;
+}
+
+void ICACHE_FLASH_ATTR httpdPlatOffloadDone(HttpdInstance *pInstance, HttpdConnData *pConn) {
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+    pRconn->offloaded = 0;
+    //Wake the select so the socket is read from again, and httpdSentCb goes on with the cgi.
+    //If closeConnection() was called meanwhile, needsClose is set and the select loop closes it.
+    httpdPlatResume(pInstance, pConn);
+}
+#endif
+
 PLAT_RETURN platHttpServerTask(void *pvParameters)
 {
     ServerTaskContext context = {0};
@@ -235,6 +429,9 @@ void platHttpServerTaskInit(ServerTaskContext *ctx, HttpdFreertosInstance *pInst
         ctx->pInstance->rconn[idxConnection].fd=-1;
     }
 
+    ctx->pInstance->wakePending = false;
+    ctx->pInstance->wakeFd = createWakeSocket();
+
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
     static int currentUdpShutdownPort = 8000;
 
@@ -335,7 +532,7 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
     for(idxConnection=0; idxConnection < ctx->pInstance->httpdInstance.maxConnections; idxConnection++) {
         RtosConnType *pRconn = &(ctx->pInstance->rconn[idxConnection]);
         if (pRconn->fd != -1) {
-            FD_SET(pRconn->fd, &readset);
+            if (!pRconn->offloaded) { FD_SET(pRconn->fd, &readset); }
             if (pRconn->needWriteDoneNotif) { FD_SET(pRconn->fd, &writeset); }
             if (pRconn->fd>maxfdp) { maxfdp = pRconn->fd; }
         } 
@@ -367,6 +564,11 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
     if(ctx->udpListenFd > maxfdp) maxfdp = ctx->udpListenFd;
 #endif
 
+    if (ctx->pInstance->wakeFd >= 0) {
+        FD_SET(ctx->pInstance->wakeFd, &readset);
+        if(ctx->pInstance->wakeFd > maxfdp) maxfdp = ctx->pInstance->wakeFd;
+    }
+
     //polling all exist client handle,wait until readable/writable
     
     int32 retSelect = select(maxfdp+1, &readset, &writeset, NULL, ctx->selectTimeoutData);
@@ -379,6 +581,17 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
     }
 #endif
 
+    //Resumed connections have their write interest set now, the next select picks them up.
+    if (ctx->pInstance->wakeFd >= 0 && FD_ISSET(ctx->pInstance->wakeFd, &readset)) {
+        char c;
+        //httpdPlatResume() is called with the server locked; draining and clearing under the
+        //lock too means a wake sent in between can't be eaten with wakePending left set.
+        httpdPlatLock(&ctx->pInstance->httpdInstance);
+        while (recv(ctx->pInstance->wakeFd, &c, 1, MSG_DONTWAIT) > 0);
+        ctx->pInstance->wakePending = false;
+        httpdPlatUnlock(&ctx->pInstance->httpdInstance);
+    }
+
     //See if we need to accept a new connection
     if (FD_ISSET(ctx->listenFd, &readset)) {
         int32 len = sizeof(struct sockaddr_in);
@@ -417,6 +630,7 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
         pRconn->fd=ctx->remoteFd;
         pRconn->needWriteDoneNotif=0;
         pRconn->needsClose=0;
+        pRconn->offloaded=0;
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
         if(ctx->pInstance->httpdFlags & HTTPD_FLAG_SSL)
@@ -550,6 +764,10 @@ PLAT_RETURN platHttpServerTaskDeinit(ServerTaskContext *ctx) {
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
     close(ctx->listenFd);
     close(ctx->udpListenFd);
+    if (ctx->pInstance->wakeFd >= 0) {
+        close(ctx->pInstance->wakeFd);
+        ctx->pInstance->wakeFd = -1;
+    }
 
     // close all open connections
     int idxConnection = 0;
@@ -559,9 +777,18 @@ PLAT_RETURN platHttpServerTaskDeinit(ServerTaskContext *ctx) {
 
         if(pRconn->fd != -1)
         {
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+            //Nothing else is served any more, the worker can be waited for.
+            while (pRconn->offloaded) {
+                vTaskDelay(10/portTICK_PERIOD_MS);
+            }
+#endif
             closeConnection(ctx->pInstance, pRconn);
         }
     }
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    httpdCacheInvalidate(&ctx->pInstance->httpdInstance, NULL);
+#endif
 
     ESP_LOGI(TAG, "httpd on %s exiting", ctx->serverStr);
     ctx->pInstance->isShutdown = true;
@@ -653,6 +880,13 @@ void httpdPlatTimerDelete(HttpdPlatTimerHandle handle)
     timer_delete(handle->timer);
     free(handle);
 }
+
+uint32_t httpdPlatGetTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 #else
 HttpdPlatTimerHandle httpdPlatTimerCreate(const char *name, int periodMs, int autoreload, void (*callback)(void *arg), void *ctx)
 {
@@ -676,6 +910,10 @@ void httpdPlatTimerStop(HttpdPlatTimerHandle timer) {
 void httpdPlatTimerDelete(HttpdPlatTimerHandle timer) {
     xTimerDelete(timer, 0);
 }
+
+uint32_t httpdPlatGetTimeMs(void) {
+    return (uint32_t)xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
 #endif
 
 //Httpd initialization routine. Call this to kick off webserver functionality.
@@ -691,12 +929,27 @@ HttpdInitStatus ICACHE_FLASH_ATTR httpdFreertosInitEx(HttpdFreertosInstance *pIn
 
     pInstance->httpdInstance.builtInUrls=fixedUrls;
     pInstance->httpdInstance.maxConnections = maxConnections;
+    pInstance->httpdInstance.wsTopics = NULL;
+#ifndef linux
+    if (sharedMux == NULL) {
+        sharedMux = xSemaphoreCreateRecursiveMutex();
+        if (sharedMux == NULL) {
+            ESP_LOGE(TAG, "Can't create shared lock");
+            return InitializationFailure;
+        }
+    }
+#endif
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    pInstance->httpdInstance.respCache = NULL;
+    pInstance->httpdInstance.respCacheCount = 0;
+#endif
 
     status = InitializationSuccess;
     pInstance->httpPort = port;
     pInstance->httpListenAddress.sin_addr.s_addr = listenAddress;
     pInstance->httpdFlags = flags;
     pInstance->isShutdown = false;
+    pInstance->wakeFd = -1;
 
     pInstance->rconn = connectionBuffer;
 
@@ -821,6 +1074,10 @@ HttpdStartStatus ICACHE_FLASH_ATTR httpdFreertosStart(HttpdFreertosInstance *pIn
     }
 #endif
 
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    offloadStart();
+#endif
+
 #ifdef linux
     pthread_t thread;
     pthread_create(&thread, NULL, platHttpServerTask, pInstance);
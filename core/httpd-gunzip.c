@@ -0,0 +1,110 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Streaming decompression of gzip files, on top of zlib, for clients that don't accept gzip. Each
+stream takes zlib's ~7k of inflate state plus a window of 2^windowBits bytes; the number of
+streams that may exist at once is capped, as that's most of the ram the server would need.
+*/
+
+#ifdef linux
+#include <libesphttpd/linux.h>
+#else
+#include <libesphttpd/esp.h>
+#endif
+
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+#include <stdatomic.h>
+#include <zlib.h>
+
+#include "httpd-gunzip.h"
+#include "esp_log.h"
+
+const static char* TAG = "httpd-gunzip";
+
+//Files compressed with a larger window than this can't be decompressed. The gzip tool always
+//uses 15.
+#ifndef CONFIG_ESPHTTPD_GUNZIP_WINDOW_BITS
+#define CONFIG_ESPHTTPD_GUNZIP_WINDOW_BITS 15
+#endif
+
+#ifndef CONFIG_ESPHTTPD_GUNZIP_MAX_STREAMS
+#define CONFIG_ESPHTTPD_GUNZIP_MAX_STREAMS 4
+#endif
+
+//Size of the buffer the compressed file is read into.
+#ifndef HTTPD_GUNZIP_IN_LEN
+#define HTTPD_GUNZIP_IN_LEN 512
+#endif
+
+struct HttpdGunzip {
+	z_stream zs;
+	HttpdGunzipReadCb read;
+	void *arg;
+	bool eof;
+	char in[HTTPD_GUNZIP_IN_LEN];
+};
+
+//Streams in use, by all server instances.
+static atomic_int activeStreams = 0;
+
+HttpdGunzip ICACHE_FLASH_ATTR *httpdGunzipNew(HttpdGunzipReadCb read, void *arg) {
+	HttpdGunzip *g;
+	int r;
+
+	//Taken first, so two callers can't both get the last one
+	if (atomic_fetch_add(&activeStreams, 1) >= CONFIG_ESPHTTPD_GUNZIP_MAX_STREAMS) {
+		atomic_fetch_sub(&activeStreams, 1);
+		ESP_LOGW(TAG, "all %d streams busy", CONFIG_ESPHTTPD_GUNZIP_MAX_STREAMS);
+		return NULL;
+	}
+	g = calloc(1, sizeof(HttpdGunzip));
+	if (g != NULL) {
+		//zlib takes 16 added to the window bits as gzip-only decoding
+		r = inflateInit2(&g->zs, CONFIG_ESPHTTPD_GUNZIP_WINDOW_BITS + 16);
+		if (r == Z_OK) {
+			g->read = read;
+			g->arg = arg;
+			return g;
+		}
+		ESP_LOGE(TAG, "inflateInit2 failed: %d", r);
+		free(g);
+	}
+	atomic_fetch_sub(&activeStreams, 1);
+	return NULL;
+}
+
+int ICACHE_FLASH_ATTR httpdGunzipRead(HttpdGunzip *g, char *out, int len) {
+	int r, n;
+
+	g->zs.next_out = (Bytef *)out;
+	g->zs.avail_out = len;
+	while (g->zs.avail_out > 0) {
+		if (g->zs.avail_in == 0 && !g->eof) {
+			n = g->read(g->arg, g->in, sizeof(g->in));
+			if (n < 0) return -1;
+			g->eof = (n == 0);
+			g->zs.next_in = (Bytef *)g->in;
+			g->zs.avail_in = n;
+		}
+		r = inflate(&g->zs, Z_NO_FLUSH);
+		if (r == Z_STREAM_END) break;
+		if (r == Z_BUF_ERROR && g->eof) {
+			ESP_LOGE(TAG, "file ends before the compressed data does");
+			return -1;
+		}
+		if (r != Z_OK && r != Z_BUF_ERROR) {
+			ESP_LOGE(TAG, "inflate failed: %d %s", r, g->zs.msg ? g->zs.msg : "");
+			return -1;
+		}
+	}
+	return len - g->zs.avail_out;
+}
+
+void ICACHE_FLASH_ATTR httpdGunzipFree(HttpdGunzip *g) {
+	inflateEnd(&g->zs);
+	free(g);
+	atomic_fetch_sub(&activeStreams, 1);
+}
+#endif // CONFIG_ESPHTTPD_GUNZIP_SUPPORT
@@ -0,0 +1,27 @@
+#ifndef HTTPD_GUNZIP_H
+#define HTTPD_GUNZIP_H
+
+typedef struct HttpdGunzip HttpdGunzip;
+
+/**
+ * Reads up to len bytes of the compressed file into buf.
+ * @return the number of bytes read, 0 at the end of the file, <0 on error
+ */
+typedef int (*HttpdGunzipReadCb)(void *arg, char *buf, int len);
+
+/**
+ * Starts decompressing a gzip file, which read gets the data of.
+ * @return NULL if out of memory or if CONFIG_ESPHTTPD_GUNZIP_MAX_STREAMS streams are busy already
+ */
+HttpdGunzip *httpdGunzipNew(HttpdGunzipReadCb read, void *arg);
+
+/**
+ * Decompresses up to len bytes into out.
+ * @return the number of bytes put in out, 0 at the end of the data, -1 if the file is corrupt or
+ * can't be read
+ */
+int httpdGunzipRead(HttpdGunzip *g, char *out, int len);
+
+void httpdGunzipFree(HttpdGunzip *g);
+
+#endif
@@ -23,6 +23,10 @@ void ICACHE_FLASH_ATTR httpdPlatLock() {
 }
 void ICACHE_FLASH_ATTR httpdPlatUnlock() {
 }
+void ICACHE_FLASH_ATTR httpdPlatSharedLock(void) {
+}
+void ICACHE_FLASH_ATTR httpdPlatSharedUnlock(void) {
+}
 
 
 static void ICACHE_FLASH_ATTR platReconCb(void *arg, sint8 err) {
@@ -11,14 +11,53 @@ int httpdPlatSendData(HttpdInstance *pInstance, HttpdConnData *pConn, char *buff
 void httpdPlatDisconnect(HttpdConnData *ponn);
 void httpdPlatDisableTimeout(HttpdConnData *pConn);
 
+/**
+ * Have the server task call httpdSentCb() for the connection soon, waking it up if it's waiting.
+ * Called with the server locked, possibly from another task.
+ */
+void httpdPlatResume(HttpdInstance *pInstance, HttpdConnData *pConn);
+
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+/**
+ * Queue a cgi call for a worker task, which calls httpdOffloadRun(). Nothing is read from the
+ * connection until httpdPlatOffloadDone(). Called with the server locked.
+ * @return false if the queue is full
+ */
+bool httpdPlatOffload(HttpdInstance *pInstance, HttpdConnData *pConn);
+
+/**
+ * Hand the connection back to the server task after an offloaded call. Called with the server locked.
+ */
+void httpdPlatOffloadDone(HttpdInstance *pInstance, HttpdConnData *pConn);
+#endif
+
+/**
+ * Lock of a server instance; its connections and the state kept per instance are only touched
+ * with it held. The server task holds it while calling cgis, except for those of offloaded
+ * routes: they run without it, so a cgi that may be offloaded takes it itself around such state.
+ */
 void httpdPlatLock(HttpdInstance *pInstance);
 void httpdPlatUnlock(HttpdInstance *pInstance);
 
+/**
+ * Lock for state shared by all server instances, like the caches of the filesystem cgis. Each
+ * instance has a task and a lock of its own, and offloaded cgis run without either, so such
+ * state is only touched with this held. Recursive; it can be taken with a server locked, but a
+ * server must not be locked while holding it.
+ */
+void httpdPlatSharedLock(void);
+void httpdPlatSharedUnlock(void);
+
 HttpdPlatTimerHandle httpdPlatTimerCreate(const char *name, int periodMs, int autoreload, void (*callback)(void *arg), void *ctx);
 void httpdPlatTimerStart(HttpdPlatTimerHandle timer);
 void httpdPlatTimerStop(HttpdPlatTimerHandle timer);
 void httpdPlatTimerDelete(HttpdPlatTimerHandle timer);
 
+/**
+ * @return milliseconds since some point in the past, wrapping around
+ */
+uint32_t httpdPlatGetTimeMs(void);
+
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
 void httpdPlatShutdown(HttpdInstance *pInstance);
 #endif
@@ -17,9 +17,17 @@ Http server - core routines
 #endif
 
 #include <strings.h>
+#include <limits.h>
 
 #include "libesphttpd/httpd.h"
+#include "libesphttpd/auth.h"
 #include "httpd-platform.h"
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+#include "httpd-deflate.h"
+#endif
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+#include "httpd-cache.h"
+#endif
 
 #include "esp_log.h"
 
@@ -31,6 +39,16 @@ const static char* TAG = "httpd";
 #define HFL_SENDINGBODY (1<<2)
 #define HFL_DISCONAFTERSENT (1<<3)
 #define HFL_NOCONNECTIONSTR (1<<4)
+#define HFL_NOBODY (1<<5)
+#define HFL_CONTENTLEN (1<<6)
+#define HFL_DISCARDBODY (1<<7)
+#define HFL_COMPRESSPENDING (1<<8)
+#define HFL_COMPRESS (1<<9)
+#define HFL_COMPRESSIBLE (1<<10)
+#define HFL_ENCODED (1<<11)
+#define HFL_SUSPENDED (1<<12)
+#define HFL_OFFLOAD (1<<13)
+#define HFL_CACHEHDRS (1<<15)
 
 
 const char *httpdCgiEx = "HttpdCgiExArg";
@@ -46,33 +64,126 @@ typedef struct {
 //#define RSTR(a) ((const char)(a))
 
 //The mappings from file extensions to mime types. If you need an extra mime type,
-//add it here.
+//add it here, or register it at runtime with httpdRegisterMimetype().
 static const ICACHE_RODATA_ATTR MimeMap mimeTypes[]={
     {"htm", "text/html"},
     {"html", "text/html"},
     {"css", "text/css"},
     {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
     {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"xml", "text/xml"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"webmanifest", "application/manifest+json"},
     {"jpg", "image/jpeg"},
     {"jpeg", "image/jpeg"},
     {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"bmp", "image/bmp"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
     {"svg", "image/svg+xml"},
-    {"xml", "text/xml"},
-    {"json", "application/json"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"bin", "application/octet-stream"},
+    {"mp3", "audio/mpeg"},
+    {"wav", "audio/wav"},
+    {"ogg", "audio/ogg"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
     {NULL, "text/html"}, //default value
 };
 
-//Returns a static char* to a mime type for a given url to a file.
-const char ICACHE_FLASH_ATTR *httpdGetMimetype(const char *url) {
-    char *urlp = (char*)url;
-    int i=0;
-    //Go find the extension
-    const char *ext=urlp+(strlen(urlp)-1);
-    while (ext!=urlp && *ext!='.') ext--;
+//Size of the extension hash table, must be a power of two. Room for the built-in
+//types above plus the ones registered by the application, with enough slack to keep
+//the probe sequences short.
+#ifndef HTTPD_MIME_TABLE_SIZE
+#define HTTPD_MIME_TABLE_SIZE 128
+#endif
+
+typedef struct {
+    uint32_t hash;
+    const char *ext;
+    const char *mimetype;
+} MimeSlot;
+
+static MimeSlot mimeTable[HTTPD_MIME_TABLE_SIZE];
+static bool mimeTableBuilt=false;
+
+//Case-insensitive FNV-1a hash of an extension
+static uint32_t ICACHE_FLASH_ATTR httpdMimeHash(const char *ext) {
+    uint32_t h=2166136261u;
+    while (*ext) {
+        h^=(uint8_t)tolower((unsigned char)*ext++);
+        h*=16777619u;
+    }
+    return h;
+}
+
+//Insert or replace an extension in the hash table. Returns false if the table is full.
+static bool ICACHE_FLASH_ATTR httpdMimeInsert(const char *ext, const char *mimetype) {
+    uint32_t h=httpdMimeHash(ext);
+    for (int n=0; n<HTTPD_MIME_TABLE_SIZE; n++) {
+        MimeSlot *slot=&mimeTable[(h+n)&(HTTPD_MIME_TABLE_SIZE-1)];
+        if (slot->ext==NULL || (slot->hash==h && strcasecmp(slot->ext, ext)==0)) {
+            slot->hash=h;
+            slot->ext=ext;
+            slot->mimetype=mimetype;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ICACHE_FLASH_ATTR httpdMimeBuildTable(void) {
+    if (mimeTableBuilt) return;
+    for (int i=0; mimeTypes[i].ext!=NULL; i++) {
+        httpdMimeInsert(mimeTypes[i].ext, mimeTypes[i].mimetype);
+    }
+    mimeTableBuilt=true;
+}
+
+//Register an extra mime type, or override a built-in one. Call this at init time,
+//before the server is started. Only the pointers are stored, so both strings must
+//stay valid for as long as the server runs.
+bool ICACHE_FLASH_ATTR httpdRegisterMimetype(const char *ext, const char *mimetype) {
+    if (ext==NULL || mimetype==NULL) return false;
     if (*ext=='.') ext++;
+    httpdMimeBuildTable();
+    if (!httpdMimeInsert(ext, mimetype)) {
+        ESP_LOGE(TAG, "mime table full, can't add %s", ext);
+        return false;
+    }
+    return true;
+}
 
-    while (mimeTypes[i].ext!=NULL && strcasecmp(ext, mimeTypes[i].ext)!=0) i++;
-    return mimeTypes[i].mimetype;
+//Returns a static char* to a mime type for a given url to a file.
+const char ICACHE_FLASH_ATTR *httpdGetMimetype(const char *url) {
+    size_t len=strlen(url);
+    const char *ext=url+len;
+    uint32_t h;
+    //Go find the extension, stopping at the start of the last path component
+    while (ext!=url && ext[-1]!='.' && ext[-1]!='/') ext--;
+    if (ext==url || ext[-1]!='.') ext=url+len; //no extension
+
+    httpdMimeBuildTable();
+    h=httpdMimeHash(ext);
+    for (int n=0; n<HTTPD_MIME_TABLE_SIZE; n++) {
+        const MimeSlot *slot=&mimeTable[(h+n)&(HTTPD_MIME_TABLE_SIZE-1)];
+        if (slot->ext==NULL) break;
+        if (slot->hash==h && strcasecmp(slot->ext, ext)==0) return slot->mimetype;
+    }
+    return mimeTypes[sizeof(mimeTypes)/sizeof(mimeTypes[0])-1].mimetype;
 }
 
 /**
@@ -91,8 +202,60 @@ void httpdAddCacheHeaders(HttpdConnData *connData, const char *mime)
     httpdHeader(connData, "Cache-Control", "max-age=7200, public, must-revalidate");
 }
 
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+//Stops keeping a copy of the response being made.
+static void ICACHE_FLASH_ATTR httpdCacheAbandon(HttpdConnData *conn) {
+    if (conn->priv.cacheFill==NULL) return;
+    httpdCacheRelease(conn->priv.cacheFill);
+    conn->priv.cacheFill=NULL;
+    conn->priv.flags&=~HFL_CACHEHDRS;
+}
+
+//Adds what the cgi sends to the copy of the response, if one is kept: the header lines after
+//the ones httpdStartResponse() sends, and the body.
+static void ICACHE_FLASH_ATTR httpdCacheCapture(HttpdConnData *conn, const char *data, int len) {
+    if (conn->priv.cacheFill==NULL || !(conn->priv.flags&(HFL_CACHEHDRS|HFL_SENDINGBODY))) return;
+    if (!httpdCacheAppend(conn->priv.cacheFill, data, len)) httpdCacheAbandon(conn);
+}
+#endif
+
+#ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
+//Queues data to be sent once the socket took what's in the backlog already.
+static void ICACHE_FLASH_ATTR httpdBacklogAdd(HttpdConnData *conn, const char *data, int len) {
+    if (conn->priv.sendBacklogSize+len>HTTPD_MAX_BACKLOG_SIZE) {
+        ESP_LOGE(TAG, "Backlog: Exceeded max backlog size, dropped %d bytes", len);
+        return;
+    }
+    HttpSendBacklogItem *i=malloc(sizeof(HttpSendBacklogItem)+len);
+    if (i==NULL) {
+        ESP_LOGE(TAG, "Backlog: malloc failed");
+        return;
+    }
+    memcpy(i->data, data, len);
+    i->len=len;
+    i->next=NULL;
+    if (conn->priv.sendBacklog==NULL) {
+        conn->priv.sendBacklog=i;
+    } else {
+        HttpSendBacklogItem *e=conn->priv.sendBacklog;
+        while (e->next!=NULL) e=e->next;
+        e->next=i;
+    }
+    conn->priv.sendBacklogSize+=len;
+}
+#endif
+
+//Lets go of the data given to httpdSendRefShared(), once it's sent or can't be anymore.
+static void ICACHE_FLASH_ATTR httpdSendRefRelease(HttpdConnData *conn) {
+    void (*done)(void *arg)=conn->priv.sendRefDone;
+    conn->priv.sendRef=NULL;
+    conn->priv.sendRefDone=NULL;
+    if (done!=NULL) done(conn->priv.sendRefDoneArg);
+}
+
 //Retires a connection for re-use
 static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdInstance *pInstance, HttpdConnData *conn) {
+    httpdSendRefRelease(conn);
 #ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
     if (conn->priv.sendBacklog!=NULL) {
         HttpSendBacklogItem *i, *j;
@@ -110,37 +273,56 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdInstance *pInstance, HttpdCon
         free(conn->post.buff);
         conn->post.buff = NULL;
     }
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+    if (conn->priv.deflate!=NULL) {
+        httpdDeflateFree(conn->priv.deflate);
+        conn->priv.deflate=NULL;
+    }
+#endif
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    httpdCacheAbandon(conn);
+#endif
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    if (conn->priv.recvStash!=NULL) {
+        free(conn->priv.recvStash);
+        conn->priv.recvStash=NULL;
+    }
+#endif
 }
 
-//Stupid li'l helper function that returns the value of a hex char.
-static int ICACHE_FLASH_ATTR  httpdHexVal(char c) {
-    if (c>='0' && c<='9') return c-'0';
-    if (c>='A' && c<='F') return c-'A'+10;
-    if (c>='a' && c<='f') return c-'a'+10;
-    return 0;
-}
+//Lookup table of hex digit values, indexed by the character. Anything that isn't a hex digit
+//maps to 0, like the old per-char helper function returned.
+static const ICACHE_RODATA_ATTR uint8_t hexVal[256]={
+    ['0']=0, ['1']=1, ['2']=2, ['3']=3, ['4']=4, ['5']=5, ['6']=6, ['7']=7, ['8']=8, ['9']=9,
+    ['A']=10, ['B']=11, ['C']=12, ['D']=13, ['E']=14, ['F']=15,
+    ['a']=10, ['b']=11, ['c']=12, ['d']=13, ['e']=14, ['f']=15,
+};
 
 bool ICACHE_FLASH_ATTR httpdUrlDecode(const char *val, int valLen, char *ret, int retLen, int* bytesWritten) {
     int s=0; // index of theread position in val
     int d=0; // index of the write position in 'ret'
-    int esced=0, escVal=0;
+    int run;
     // d loops for (retLen - 1) to ensure there is space for the null terminator
     while (s<valLen && d < (retLen - 1)) {
-        if (esced==1)  {
-            escVal=httpdHexVal(val[s])<<4;
-            esced=2;
-        } else if (esced==2) {
-            escVal+=httpdHexVal(val[s]);
-            ret[d++]=escVal;
-            esced=0;
-        } else if (val[s]=='%') {
-            esced=1;
-        } else if (val[s]=='+') {
+        //Copy the run of literal characters up to the next escape in one go
+        run=0;
+        while (s+run<valLen && d+run<(retLen - 1) && val[s+run]!='%' && val[s+run]!='+') run++;
+        if (run>0) {
+            memcpy(&ret[d], &val[s], run);
+            s+=run;
+            d+=run;
+            continue;
+        }
+        if (val[s]=='+') {
             ret[d++]=' ';
+            s++;
+        } else if (s+2<valLen) {
+            ret[d++]=(hexVal[(uint8_t)val[s+1]]<<4)|hexVal[(uint8_t)val[s+2]];
+            s+=3;
         } else {
-            ret[d++]=val[s];
+            //Truncated escape at the end of the input, nothing to decode
+            s=valLen;
         }
-        s++;
     }
 
     ret[d++] = 0;
@@ -223,42 +405,322 @@ void ICACHE_FLASH_ATTR httpdSetTransferMode(HttpdConnData *conn, TransferModes m
     }
 }
 
+//Announce the exact length of the body instead of sending it chunked. The connection is
+//kept alive like it is with chunked encoding, but the body goes out without chunk framing.
+//Must be called before httpdStartResponse(), and the cgi must send exactly len body bytes.
+void ICACHE_FLASH_ATTR httpdSetContentLength(HttpdConnData *conn, long len) {
+    conn->priv.flags|=HFL_CONTENTLEN;
+    conn->priv.contentLen=len;
+}
+
+//Returns the reason phrase for the status codes the server and the bundled cgis use.
+static const char ICACHE_FLASH_ATTR *httpdStatusText(int code) {
+    switch (code) {
+        case 101: return "Switching Protocols";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Content Too Large";
+        case 414: return "URI Too Long";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default: return "OK";
+    }
+}
+
 //Start the response headers.
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
     char buff[128];
     int l;
     const char *connStr="Connection: close\r\n";
-    if (conn->priv.flags&HFL_CHUNKED) connStr="Transfer-Encoding: chunked\r\n";
+    //1xx, 204 and 304 responses never carry a body, so there is no chunked body to announce.
+    if (code<200 || code==204 || code==304) conn->priv.flags|=HFL_NOBODY;
+    if (conn->priv.flags&HFL_CHUNKED) connStr=(conn->priv.flags&(HFL_NOBODY|HFL_CONTENTLEN))?"":"Transfer-Encoding: chunked\r\n";
     if (conn->priv.flags&HFL_NOCONNECTIONSTR) connStr="";
-    l=snprintf(buff, sizeof(buff), "HTTP/1.%d %d OK\r\nServer: esp-httpd/"HTTPDVER"\r\n%s",
+    l=snprintf(buff, sizeof(buff), "HTTP/1.%d %d %s\r\nServer: esp-httpd/"HTTPDVER"\r\n%s",
                 (conn->priv.flags&HFL_HTTP11)?1:0,
                 code,
+                httpdStatusText(code),
                 connStr);
     if(l >= sizeof(buff))
     {
         ESP_LOGE(TAG, "buff[%zu] too small", sizeof(buff));
     }
     httpdSend(conn, buff, l);
+    if ((conn->priv.flags&HFL_CONTENTLEN) && !(conn->priv.flags&HFL_NOBODY)) {
+        l=snprintf(buff, sizeof(buff), "Content-Length: %ld\r\n", conn->priv.contentLen);
+        httpdSend(conn, buff, l);
+    }
 
 #ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
     // CORS headers
     httpdSend(conn, "Access-Control-Allow-Origin: *\r\n", -1);
     httpdSend(conn, "Access-Control-Allow-Methods: GET,POST,PUT,DELETE,OPTIONS\r\n", -1);
 #endif
+
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    //Only plain successful responses are kept. The copy starts with what the cgi sends next.
+    if (conn->priv.cacheFill!=NULL) {
+        if (code==200 && !(conn->priv.flags&HFL_NOCONNECTIONSTR)) {
+            conn->priv.cacheFill->code=code;
+            conn->priv.flags|=HFL_CACHEHDRS;
+        } else {
+            httpdCacheAbandon(conn);
+        }
+    }
+#endif
 }
 
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+//Content types worth compressing. Not text/event-stream: its events have to reach the client
+//when they are sent, not when the compressor has collected enough of them.
+static const char *const compressibleTypes[]={
+    "text/", "application/json", "application/javascript", "application/xml", "image/svg+xml", NULL
+};
+
+static bool ICACHE_FLASH_ATTR httpdIsCompressibleType(const char *type) {
+    int i;
+    if (strncasecmp(type, "text/event-stream", 17)==0) return false;
+    for (i=0; compressibleTypes[i]!=NULL; i++) {
+        if (strncasecmp(type, compressibleTypes[i], strlen(compressibleTypes[i]))==0) return true;
+    }
+    return false;
+}
+#endif
+
 //Send a http header.
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+    if (strcasecmp(field, "Content-Type")==0 && httpdIsCompressibleType(val)) conn->priv.flags|=HFL_COMPRESSIBLE;
+    if (strcasecmp(field, "Content-Encoding")==0) conn->priv.flags|=HFL_ENCODED;
+#endif
     httpdSend(conn, field, -1);
     httpdSend(conn, ": ", -1);
     httpdSend(conn, val, -1);
     httpdSend(conn, "\r\n", -1);
 }
 
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+//Called at the end of the headers. If the route wants its responses compressed and this one
+//can be, adds the Content-Encoding header. Whether the body really is compressed is decided
+//when the first of it is sent, see httpdStartCompression(); if not, the header is taken out.
+static void ICACHE_FLASH_ATTR httpdPrepareCompression(HttpdConnData *conn) {
+    const char *encHdr=NULL;
+    int gzipQ, deflateQ;
+
+    if (conn->priv.routeOpts==NULL || !conn->priv.routeOpts->compress) return;
+    if ((conn->priv.flags&(HFL_NOBODY|HFL_CONTENTLEN|HFL_NOCONNECTIONSTR|HFL_ENCODED)) ||
+            !(conn->priv.flags&HFL_COMPRESSIBLE)) return;
+    //What's sent depends on what the client accepts, caches need to know that.
+    httpdSend(conn, "Vary: Accept-Encoding\r\n", -1);
+    gzipQ=httpdGetEncodingQ(conn, "gzip");
+    deflateQ=httpdGetEncodingQ(conn, "deflate");
+    if (gzipQ>0 && gzipQ>=deflateQ) {
+        encHdr="Content-Encoding: gzip\r\n";
+    } else if (deflateQ>0) {
+        encHdr="Content-Encoding: deflate\r\n";
+    } else {
+        return;
+    }
+    if (!httpdSend(conn, encHdr, -1)) return;
+    conn->priv.encHdr=encHdr;
+    conn->priv.encHdrPos=conn->priv.sendBuffLen-strlen(encHdr);
+    conn->priv.flags|=HFL_COMPRESSPENDING;
+}
+#endif
+
 //Finish the headers.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    if (conn->priv.flags&HFL_CACHEHDRS) {
+        conn->priv.flags&=~HFL_CACHEHDRS;
+        conn->priv.cacheFill->hdrLen=conn->priv.cacheFill->len;
+        conn->priv.cacheFill->flags=conn->priv.flags&(HFL_COMPRESSIBLE|HFL_ENCODED);
+    }
+#endif
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+    httpdPrepareCompression(conn);
+#endif
     httpdSend(conn, "\r\n", -1);
-    conn->priv.flags|=HFL_SENDINGBODY;
+    if (!(conn->priv.flags&HFL_NOBODY)) conn->priv.flags|=HFL_SENDINGBODY;
+}
+
+//Parses a q-value ("1", "0.5", "0.125"...) into thousandths.
+static int ICACHE_FLASH_ATTR httpdParseQ(const char *p) {
+    int q, scale=100;
+    if (*p!='0' && *p!='1') return 0;
+    q=(*p=='1')?1000:0;
+    p++;
+    if (*p=='.') {
+        for (p++; *p>='0' && *p<='9' && scale>0; p++) {
+            if (q<1000) q+=(*p-'0')*scale;
+            scale/=10;
+        }
+    }
+    return q;
+}
+
+int ICACHE_FLASH_ATTR httpdGetEncodingQ(HttpdConnData *conn, const char *coding) {
+    char buff[128];
+    char *p=buff;
+    char *name;
+    int nameLen, q;
+    int starQ=-1;
+
+    if (!httpdGetHeader(conn, "Accept-Encoding", buff, sizeof(buff))) {
+        //No preference given, only identity is safe to assume
+        return (strcasecmp(coding, "identity")==0)?1000:0;
+    }
+    while (*p!=0) {
+        while (*p==' ' || *p==',') p++;
+        name=p;
+        while (*p!=0 && *p!=',' && *p!=';' && *p!=' ') p++;
+        nameLen=p-name;
+        q=1000;
+        //Parameters of the coding; q is the only one that means anything
+        while (*p!=0 && *p!=',') {
+            if (*p++!=';') continue;
+            while (*p==' ') p++;
+            if ((*p=='q' || *p=='Q') && p[1]=='=') q=httpdParseQ(p+2);
+        }
+        if (nameLen==strlen(coding) && strncasecmp(name, coding, nameLen)==0) return q;
+        if (nameLen==1 && *name=='*') starQ=q;
+    }
+    //Codings the client doesn't name get the q-value of '*', if given. Identity is acceptable
+    //unless excluded, but comes after anything the client does name.
+    if (starQ>=0) return starQ;
+    return (strcasecmp(coding, "identity")==0)?1:0;
+}
+
+static const char *const encodingSuffixes[HTTPD_ENC_COUNT]={".br", ".gz", ""};
+static const char *const encodingNames[HTTPD_ENC_COUNT]={"br", "gzip", "identity"};
+
+const char ICACHE_FLASH_ATTR *httpdEncodingSuffix(HttpdEncoding enc) {
+    return encodingSuffixes[enc];
+}
+
+const char ICACHE_FLASH_ATTR *httpdEncodingName(HttpdEncoding enc) {
+    return encodingNames[enc];
+}
+
+HttpdEncoding ICACHE_FLASH_ATTR httpdNegotiateEncoding(HttpdConnData *conn, unsigned int available) {
+    HttpdEncoding enc;
+    HttpdEncoding best=HTTPD_ENC_COUNT;
+    int q, bestQ=0;
+    //Only a higher q-value beats an earlier variant, so ties go by the order of HttpdEncoding.
+    for (enc=0; enc<HTTPD_ENC_COUNT; enc++) {
+        if (!(available&HTTPD_ENC_BIT(enc))) continue;
+        q=httpdGetEncodingQ(conn, encodingNames[enc]);
+        if (q>bestQ) {
+            best=enc;
+            bestQ=q;
+        }
+    }
+    return best;
+}
+
+//FNV-1a hash of a path. Never 0, as that marks an unused cache slot.
+uint32_t ICACHE_FLASH_ATTR httpdPathHash(const char *path) {
+    uint32_t h=2166136261u;
+    while (*path) {
+        h^=(uint8_t)*path++;
+        h*=16777619u;
+    }
+    return h?h:1;
+}
+
+bool ICACHE_FLASH_ATTR httpdVariantCacheGet(HttpdVariantCacheEntry *cache, int size, const char *path, uint8_t *variants) {
+    uint32_t h=httpdPathHash(path);
+    HttpdVariantCacheEntry *e=&cache[h%size];
+    if (e->hash!=h) return false;
+    *variants=e->variants;
+    return true;
+}
+
+void ICACHE_FLASH_ATTR httpdVariantCachePut(HttpdVariantCacheEntry *cache, int size, const char *path, uint8_t variants) {
+    uint32_t h=httpdPathHash(path);
+    cache[h%size].hash=h;
+    cache[h%size].variants=variants;
+}
+
+//Checks the entity tag of the resource against the If-None-Match header of the request.
+//Returns true if the client already has this version of the resource, in which case a
+//304 Not Modified response should be sent instead of the body.
+bool ICACHE_FLASH_ATTR httpdEtagMatches(HttpdConnData *conn, const char *etag) {
+    char buff[160];
+    char *p, *e;
+    size_t etagLen=strlen(etag);
+
+    if (!httpdGetHeader(conn, "If-None-Match", buff, sizeof(buff))) return false;
+    p=buff;
+    while (*p!=0) {
+        while (*p==' ' || *p==',') p++; //skip list separators
+        if (*p=='*') return true;
+        if (strncmp(p, "W/", 2)==0) p+=2; //If-None-Match uses the weak comparison
+        e=p;
+        while (*e!=0 && *e!=',') e++;
+        while (e>p && e[-1]==' ') e--;
+        if ((size_t)(e-p)==etagLen && strncmp(p, etag, etagLen)==0) return true;
+        p=e;
+        while (*p!=0 && *p!=',') p++;
+    }
+    return false;
+}
+
+//Parses the Range header of a GET request for an entity of the given size. Only a single
+//byte range is supported; a request for multiple ranges is answered with the whole entity,
+//which the HTTP spec allows. If etag is given, an If-Range header that names another
+//version of the entity also gets the whole entity.
+HttpdRangeResult ICACHE_FLASH_ATTR httpdGetRange(HttpdConnData *conn, long size, const char *etag, long *start, long *end) {
+    char buff[64];
+    char *p, *e;
+    long first, last;
+
+    if (conn->requestType!=HTTPD_METHOD_GET) return HTTPD_RANGE_NONE;
+    if (!httpdGetHeader(conn, "Range", buff, sizeof(buff))) return HTTPD_RANGE_NONE;
+    if (strncmp(buff, "bytes=", 6)!=0) return HTTPD_RANGE_NONE;
+    if (strchr(buff, ',')!=NULL) return HTTPD_RANGE_NONE; //multiple ranges, send everything
+
+    p=buff+6;
+    while (*p==' ') p++;
+    e=p+strlen(p);
+    while (e>p && e[-1]==' ') *--e=0; //strip trailing spaces
+
+    if (*p=='-') {
+        //Suffix range: the last n bytes of the entity
+        last=strtol(p+1, &e, 10);
+        if (e==p+1 || *e!=0 || last<0) return HTTPD_RANGE_NONE;
+        if (last==0 || size<=0) return HTTPD_RANGE_UNSATISFIABLE;
+        first=(last>size)?0:size-last;
+        last=size-1;
+    } else {
+        first=strtol(p, &e, 10);
+        if (e==p || *e!='-' || first<0) return HTTPD_RANGE_NONE;
+        p=e+1;
+        if (*p==0) {
+            last=size-1;
+        } else {
+            last=strtol(p, &e, 10);
+            if (e==p || *e!=0 || last<first) return HTTPD_RANGE_NONE;
+            if (last>=size) last=size-1;
+        }
+        if (first>=size) return HTTPD_RANGE_UNSATISFIABLE;
+    }
+
+    //If-Range is only honoured with an entity tag; we never send Last-Modified.
+    if (httpdGetHeader(conn, "If-Range", buff, sizeof(buff))) {
+        if (etag==NULL || strcmp(buff, etag)!=0) return HTTPD_RANGE_NONE;
+    }
+
+    *start=first;
+    *end=last;
+    return HTTPD_RANGE_OK;
 }
 
 //Redirect to the given URL.
@@ -283,117 +745,393 @@ static CgiStatus ICACHE_FLASH_ATTR cgiNotFound(HttpdConnData *connData) {
     return HTTPD_CGI_MORE; // make sure to eat-up all the post data that the client may be sending!
 }
 
-static const char* CHUNK_SIZE_TEXT = "0000\r\n";
-static const int CHUNK_SIZE_TEXT_LEN = 6; // number of characters in CHUNK_SIZE_TEXT
+//Room reserved in front of every chunk for its size line. The size is only known once the
+//chunk is flushed, so the line is written then, right-aligned against the chunk data.
+#if HTTPD_SENDBUFF_SIZE <= 0xffff
+#define CHUNK_HDR_MAX_LEN 6 // 4 hex digits + "\r\n"
+#else
+#define CHUNK_HDR_MAX_LEN 10 // 8 hex digits + "\r\n"
+#endif
 
-//Add data to the send buffer. len is the length of the data. If len is -1
-//the data is seen as a C-string.
-//Returns 1 for success, 0 for out-of-memory.
-int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
-    if (len<0) len=strlen(data);
-    if (len==0) return 0;
-    if (conn->priv.flags&HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY && conn->priv.chunkHdr==NULL)
+//True if the next byte added to the send buffer has to start a new chunk
+static bool ICACHE_FLASH_ATTR httpdNeedsChunkStart(HttpdConnData *conn) {
+    return (conn->priv.flags&HFL_CHUNKED) && (conn->priv.flags&HFL_SENDINGBODY) &&
+        !(conn->priv.flags&(HFL_CONTENTLEN|HFL_COMPRESS)) && conn->priv.chunkHdr==NULL;
+}
+
+//Reserve len bytes at the end of the send buffer, starting a chunk first if the body is
+//being sent chunked. Returns where the caller must write exactly len bytes, or NULL if
+//they don't fit.
+static char ICACHE_FLASH_ATTR *httpdSendReserve(HttpdConnData *conn, int len) {
+    char *p;
+    if (conn->priv.sendRef!=NULL) return NULL; //would go out before it
+    if (httpdNeedsChunkStart(conn))
     {
-        if (conn->priv.sendBuffLen+len+CHUNK_SIZE_TEXT_LEN > HTTPD_SENDBUFF_MAX_FILL) return 0;
+        if (conn->priv.sendBuffLen+len+CHUNK_HDR_MAX_LEN > HTTPD_SENDBUFF_MAX_FILL) return NULL;
 
-        // Establish start of chunk
-        // Use a chunk length placeholder of 4 characters
+        // Establish start of chunk, leaving room for the size line
         conn->priv.chunkHdr = &conn->priv.sendBuff[conn->priv.sendBuffLen];
-        strcpy(conn->priv.chunkHdr, CHUNK_SIZE_TEXT);
-        conn->priv.sendBuffLen+=CHUNK_SIZE_TEXT_LEN;
+        conn->priv.sendBuffLen+=CHUNK_HDR_MAX_LEN;
         assert(conn->priv.sendBuffLen <= HTTPD_SENDBUFF_MAX_FILL);
     }
-    if (conn->priv.sendBuffLen+len > HTTPD_SENDBUFF_MAX_FILL) return 0;
-    memcpy(conn->priv.sendBuff+conn->priv.sendBuffLen, data, len);
+    if (conn->priv.sendBuffLen+len > HTTPD_SENDBUFF_MAX_FILL) return NULL;
+    p=conn->priv.sendBuff+conn->priv.sendBuffLen;
     conn->priv.sendBuffLen+=len;
     assert(conn->priv.sendBuffLen <= HTTPD_SENDBUFF_MAX_FILL);
+    return p;
+}
+
+//Add data to the send buffer. len is the length of the data. If len is -1
+//the data is seen as a C-string.
+//Returns 1 for success, 0 for out-of-memory.
+int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
+    char *p;
+    if (len<0) len=strlen(data);
+    if (len==0) return 0;
+    p=httpdSendReserve(conn, len);
+    if (p==NULL) return 0;
+    memcpy(p, data, len);
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    httpdCacheCapture(conn, data, len);
+#endif
     return 1;
 }
 
-static char ICACHE_FLASH_ATTR httpdHexNibble(int val)
-{
-    val&=0xf;
-    if (val<10) return '0'+val;
-    return 'A'+(val-10);
+//Returns how many bytes httpdSend() or httpdSendPartial() can take right now.
+int ICACHE_FLASH_ATTR httpdSendAvail(HttpdConnData *conn) {
+    int avail=HTTPD_SENDBUFF_MAX_FILL-conn->priv.sendBuffLen;
+    if (conn->priv.sendRef!=NULL) return 0;
+    if (httpdNeedsChunkStart(conn)) avail-=CHUNK_HDR_MAX_LEN;
+    return (avail>0)?avail:0;
 }
 
-#define httpdSend_orDie(conn, data, len) do { if (!httpdSend((conn), (data), (len))) return false; } while (0)
+//True if nothing waits in the send buffer and a flush empties it again: there's no data sent
+//by reference pending, and no worker owns the buffer.
+bool ICACHE_FLASH_ATTR httpdSendBuffEmpty(HttpdConnData *conn) {
+    if (conn->priv.sendBuffLen!=0 || conn->priv.sendRef!=NULL) return false;
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    if (conn->priv.offloaded) return false;
+#endif
+    return true;
+}
 
-/* encode for HTML. returns 0 or 1 - 1 = success */
-int ICACHE_FLASH_ATTR httpdSend_html(HttpdConnData *conn, const char *data, int len)
+//Add as much of the data to the send buffer as fits. If len is -1 the data is seen as
+//a C-string. Returns the number of bytes taken; the cgi should send the rest on its
+//next call.
+int ICACHE_FLASH_ATTR httpdSendPartial(HttpdConnData *conn, const char *data, int len) {
+    int avail;
+    if (len<0) len=strlen(data);
+    avail=httpdSendAvail(conn);
+    if (len>avail) len=avail;
+    if (len==0) return 0;
+    memcpy(httpdSendReserve(conn, len), data, len);
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    httpdCacheCapture(conn, data, len);
+#endif
+    return len;
+}
+
+int ICACHE_FLASH_ATTR httpdSendRef(HttpdConnData *conn, const char *data, int len) {
+    if (len<0) len=strlen(data);
+    if (len==0) return 0;
+    //The compressor needs the data in the send buffer. The chunk size line of the data is
+    //written behind the buffer contents when it's flushed, so that has to fit too.
+    if (conn->priv.sendRef!=NULL || (conn->priv.flags&(HFL_COMPRESS|HFL_COMPRESSPENDING)) ||
+            conn->priv.sendBuffLen+2+CHUNK_HDR_MAX_LEN>HTTPD_SENDBUFF_SIZE) {
+        return httpdSendPartial(conn, data, len);
+    }
+    conn->priv.sendRef=data;
+    conn->priv.sendRefLen=len;
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    httpdCacheCapture(conn, data, len);
+#endif
+    return len;
+}
+
+bool ICACHE_FLASH_ATTR httpdSendRefShared(HttpdConnData *conn, const char *data, int len, void (*done)(void *arg), void *arg) {
+#ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
+    //A connection that's behind gets what's still pending by reference copied to the backlog,
+    //so this can be queued after it instead of being refused.
+    if (len>0 && conn->priv.sendRef!=NULL && conn->priv.sendRefTrailer==NULL) {
+        httpdBacklogAdd(conn, conn->priv.sendRef, conn->priv.sendRefLen);
+        httpdSendRefRelease(conn);
+    }
+#endif
+    if (len<=0 || conn->priv.sendRef!=NULL || (conn->priv.flags&(HFL_COMPRESS|HFL_COMPRESSPENDING)) ||
+            conn->priv.sendBuffLen+2+CHUNK_HDR_MAX_LEN>HTTPD_SENDBUFF_SIZE) {
+        return false;
+    }
+    httpdSendRef(conn, data, len);
+    conn->priv.sendRefDone=done;
+    conn->priv.sendRefDoneArg=arg;
+    return true;
+}
+
+//Escape sequences for httpdSend_html() and httpdSend_js(). The tables below map every byte
+//to its escape (1-based index), ESC_END for the terminating NUL, or 0 if it's sent as is.
+#define ESC_END 0xff
+
+static const char *const htmlEscapes[]={"&#34;", "&#39;", "&lt;", "&gt;"};
+static const ICACHE_RODATA_ATTR uint8_t htmlEscIdx[256]={
+    [0]=ESC_END, ['"']=1, ['\'']=2, ['<']=3, ['>']=4,
+};
+
+static const char *const jsEscapes[]={"\\\"", "\\'", "\\\\", "\\u003C", "\\u003E", "\\n", "\\r"};
+static const ICACHE_RODATA_ATTR uint8_t jsEscIdx[256]={
+    [0]=ESC_END, ['"']=1, ['\'']=2, ['\\']=3, ['<']=4, ['>']=5, ['\n']=6, ['\r']=7,
+};
+
+//Copies data into the send buffer, escaping it on the way. Runs of bytes that don't need
+//escaping are copied in one go, together with the escape sequence that ends them.
+static int ICACHE_FLASH_ATTR httpdSendEscaped(HttpdConnData *conn, const char *data, int len,
+                                              const uint8_t *escIdx, const char *const *escapes)
 {
-    int start = 0, end = 0;
-    char c;
+    const uint8_t *p=(const uint8_t *)data;
+    const uint8_t *end;
+    const uint8_t *run;
+    const char *esc;
+    int runLen, escLen;
+    char *out;
+
     if (len < 0) len = (int) strlen(data);
     if (len==0) return 0;
-
-    for (end = 0; end < len; end++)
-    {
-        c = data[end];
-        if (c == 0) {
-            // we found EOS
-            break;
+    end=p+len;
+
+    while (p<end) {
+        run=p;
+        while (p<end && escIdx[*p]==0) p++;
+        runLen=p-run;
+        esc=NULL;
+        escLen=0;
+        if (p<end && escIdx[*p]!=ESC_END) {
+            esc=escapes[escIdx[*p]-1];
+            escLen=strlen(esc);
         }
-
-        if (c == '"' || c == '\'' || c == '<' || c == '>')
-        {
-            if (start < end) httpdSend_orDie(conn, data + start, end - start);
-            start = end + 1;
+        if (runLen+escLen>0) {
+            out=httpdSendReserve(conn, runLen+escLen);
+            if (out==NULL) return 0;
+            memcpy(out, run, runLen);
+            memcpy(out+runLen, esc, escLen);
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+            httpdCacheCapture(conn, out, runLen+escLen);
+#endif
         }
-
-        if (c == '"') httpdSend_orDie(conn, "&#34;", 5);
-        else if (c == '\'') httpdSend_orDie(conn, "&#39;", 5);
-        else if (c == '<') httpdSend_orDie(conn, "&lt;", 4);
-        else if (c == '>') httpdSend_orDie(conn, "&gt;", 4);
+        if (p==end || escIdx[*p]==ESC_END) break; // we found EOS
+        p++;
     }
-
-    if (start < end) httpdSend_orDie(conn, data + start, end - start);
     return 1;
 }
 
+/* encode for HTML. returns 0 or 1 - 1 = success */
+int ICACHE_FLASH_ATTR httpdSend_html(HttpdConnData *conn, const char *data, int len)
+{
+    return httpdSendEscaped(conn, data, len, htmlEscIdx, htmlEscapes);
+}
+
 /* encode for JS. returns 0 or 1 - 1 = success */
 int ICACHE_FLASH_ATTR httpdSend_js(HttpdConnData *conn, const char *data, int len)
 {
-    int start = 0, end = 0;
-    char c;
-    if (len < 0) len = (int) strlen(data);
-    if (len==0) return 0;
+    return httpdSendEscaped(conn, data, len, jsEscIdx, jsEscapes);
+}
 
-    for (end = 0; end < len; end++)
-    {
-        c = data[end];
-        if (c == 0)
-        {
-            // we found EOS
-            break;
+//Sends len bytes straight to the connection. What the socket doesn't take goes into the backlog,
+//if there is one.
+static void ICACHE_FLASH_ATTR httpdSendOut(HttpdInstance *pInstance, HttpdConnData *conn, char *data, int len) {
+    int r;
+    if (len==0) return;
+#ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
+    //Behind what's in the backlog already, or it would go out of order
+    if (conn->priv.sendBacklog!=NULL) r = 0; else
+#endif
+    r = httpdPlatSendData(pInstance, conn, data, len);
+    if (r != len) {
+#ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
+        //Can't send this for some reason. Dump what's left of it in backlog, we can send it later.
+        if (r > 0) {
+            data += r;
+            len -= r;
         }
+        httpdBacklogAdd(conn, data, len);
+#else
+        ESP_LOGE(TAG, "send buf tried to write %d bytes, wrote %d", len, r);
+#endif
+    }
+}
+
+//The cgi of a response whose body is handed to httpdServeStream(). Reads the source straight
+//into the send buffer, as much as it takes each time the connection can take more.
+static CgiStatus ICACHE_FLASH_ATTR httpdStreamCgi(HttpdConnData *conn) {
+    const HttpdStreamOps *ops=conn->priv.streamOps;
+    bool newChunk;
+    char *p;
+    int len, n=0;
+
+    if (!conn->isConnectionClosed && conn->priv.streamLeft!=0) {
+        len=httpdSendAvail(conn);
+        if (conn->priv.streamLeft>0 && len>conn->priv.streamLeft) len=conn->priv.streamLeft;
+        if (len==0) return HTTPD_CGI_MORE;
+        newChunk=httpdNeedsChunkStart(conn);
+        p=httpdSendReserve(conn, len);
+        n=ops->read(conn->priv.streamCtx, p, len);
+        //Give back what wasn't filled, and the chunk that didn't get any data
+        conn->priv.sendBuffLen-=len-((n>0)?n:0);
+        if (n<=0 && newChunk) {
+            conn->priv.sendBuffLen-=CHUNK_HDR_MAX_LEN;
+            conn->priv.chunkHdr=NULL;
+        }
+        if (n>0) {
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+            httpdCacheCapture(conn, p, n);
+#endif
+            if (conn->priv.streamLeft>0) conn->priv.streamLeft-=n;
+            if (conn->priv.streamLeft!=0) return HTTPD_CGI_MORE;
+        } else if (n<0 || conn->priv.streamLeft>0) {
+            //The client can only tell the body is incomplete by the connection being closed.
+            ESP_LOGE(TAG, "stream of %s ended early", conn->url);
+            httpdSetTransferMode(conn, HTTPD_TRANSFER_CLOSE);
+        }
+    }
+    if (ops->close!=NULL) ops->close(conn->priv.streamCtx);
+    conn->priv.streamOps=NULL;
+    conn->priv.streamCtx=NULL;
+    return HTTPD_CGI_DONE;
+}
+
+//Returns true if the cgi can be called again with data already in the send buffer: the
+//server's own stream reader, and cgis of routes that say they size their output to the room.
+static bool ICACHE_FLASH_ATTR httpdCgiCoalesces(HttpdConnData *conn) {
+    return conn->cgi==httpdStreamCgi || (conn->priv.routeOpts!=NULL && conn->priv.routeOpts->coalesce);
+}
+
+CgiStatus ICACHE_FLASH_ATTR httpdServeStream(HttpdConnData *conn, const HttpdStreamOps *ops, void *ctx, long len) {
+    conn->priv.streamOps=ops;
+    conn->priv.streamCtx=ctx;
+    conn->priv.streamLeft=len;
+    conn->cgi=httpdStreamCgi;
+    return HTTPD_CGI_MORE;
+}
 
-        if (c == '"' || c == '\\' || c == '\'' || c == '<' || c == '>' || c == '\n' || c == '\r') {
-            if (start < end) httpdSend_orDie(conn, data + start, end - start);
-            start = end + 1;
+//Sends the next part of the data given to httpdSendRef(), and after the last part what ends
+//its chunk.
+static void ICACHE_FLASH_ATTR httpdSendRefSegment(HttpdInstance *pInstance, HttpdConnData *conn) {
+    int len=conn->priv.sendRefLen;
+#ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
+    if (conn->priv.sendBacklog!=NULL) return; //once the socket took that
+#endif
+    if (len>HTTPD_SENDREF_SEGMENT_LEN) len=HTTPD_SENDREF_SEGMENT_LEN;
+    httpdSendOut(pInstance, conn, (char *)conn->priv.sendRef, len);
+    conn->priv.sendRef+=len;
+    conn->priv.sendRefLen-=len;
+    if (conn->priv.sendRefLen>0) return;
+    httpdSendRefRelease(conn);
+    if (conn->priv.sendRefTrailer!=NULL) {
+        httpdSendOut(pInstance, conn, (char *)conn->priv.sendRefTrailer, strlen(conn->priv.sendRefTrailer));
+        conn->priv.sendRefTrailer=NULL;
+    }
+}
+
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+//Decides, on the first flush of a response prepared by httpdPrepareCompression(), whether its
+//body is compressed. It is unless the cgi is already done and the body is too small to bother.
+//If so, sends the headers. If not, takes the Content-Encoding header out again. Returns the
+//offset in sendBuff of the first byte still to send.
+static int ICACHE_FLASH_ATTR httpdStartCompression(HttpdInstance *pInstance, HttpdConnData *conn) {
+    int encLen=strlen(conn->priv.encHdr);
+    int hdrEnd=conn->priv.encHdrPos+encLen+2;
+    int bodyStart=hdrEnd;
+    int minLen=conn->priv.routeOpts->compressMinLen;
+
+    conn->priv.flags&=~HFL_COMPRESSPENDING;
+    if (minLen<=0) minLen=HTTPD_DEFLATE_MIN_LEN;
+    if (conn->priv.chunkHdr!=NULL) bodyStart=(conn->priv.chunkHdr-conn->priv.sendBuff)+CHUNK_HDR_MAX_LEN;
+    if (conn->cgi!=NULL || conn->priv.sendBuffLen-bodyStart>=minLen) {
+        conn->priv.deflate=httpdDeflateNew(strstr(conn->priv.encHdr, "gzip")!=NULL);
+        if (conn->priv.deflate!=NULL) {
+            conn->priv.flags|=HFL_COMPRESS;
+            //The body gets chunks of its own, after compression
+            conn->priv.chunkHdr=NULL;
+            httpdSendOut(pInstance, conn, conn->priv.sendBuff, hdrEnd);
+            return bodyStart;
         }
+        ESP_LOGE(TAG, "no memory to compress %s, sending it as is", conn->url);
+    }
+    memmove(conn->priv.sendBuff+encLen, conn->priv.sendBuff, conn->priv.encHdrPos);
+    return encLen;
+}
 
-        if (c == '"') httpdSend_orDie(conn, "\\\"", 2);
-        else if (c == '\'') httpdSend_orDie(conn, "\\'", 2);
-        else if (c == '\\') httpdSend_orDie(conn, "\\\\", 2);
-        else if (c == '<') httpdSend_orDie(conn, "\\u003C", 6);
-        else if (c == '>') httpdSend_orDie(conn, "\\u003E", 6);
-        else if (c == '\n') httpdSend_orDie(conn, "\\n", 2);
-        else if (c == '\r') httpdSend_orDie(conn, "\\r", 2);
+typedef struct {
+    HttpdInstance *pInstance;
+    HttpdConnData *conn;
+} DeflateOutArg;
+
+//Sends a piece of compressed body, as a chunk if the response is chunked.
+static void ICACHE_FLASH_ATTR httpdDeflateOut(void *arg, char *data, int len, bool last) {
+    DeflateOutArg *out=(DeflateOutArg *)arg;
+    char *end=data+len;
+    char hdr[HTTPD_DEFLATE_HEADROOM+1];
+    int hdrLen;
+
+    if (out->conn->priv.flags&HFL_CHUNKED) {
+        if (len>0) {
+            hdrLen=snprintf(hdr, sizeof(hdr), "%X\r\n", len);
+            data-=hdrLen;
+            memcpy(data, hdr, hdrLen);
+            memcpy(end, "\r\n", 2);
+            end+=2;
+        }
+        if (last) {
+            memcpy(end, "0\r\n\r\n", 5);
+            end+=5;
+        }
     }
+    httpdSendOut(out->pInstance, out->conn, data, end-data);
+}
 
-    if (start < end) httpdSend_orDie(conn, data + start, end - start);
-    return 1;
+//Runs the body bytes in the send buffer from start on through the compressor. Once the cgi is
+//done, the compressed stream is finished.
+static void ICACHE_FLASH_ATTR httpdFlushCompressed(HttpdInstance *pInstance, HttpdConnData *conn, int start) {
+    DeflateOutArg out={pInstance, conn};
+    bool finish=(conn->cgi==NULL);
+
+    if (conn->priv.deflate==NULL) return;
+    if (!httpdDeflateData(conn->priv.deflate, conn->priv.sendBuff+start, conn->priv.sendBuffLen-start,
+                finish, httpdDeflateOut, &out)) {
+        //The rest of the body can't be made sense of anymore, so don't send any.
+        httpdPlatDisconnect(conn);
+        finish=true;
+    }
+    if (finish) {
+        httpdDeflateFree(conn->priv.deflate);
+        conn->priv.deflate=NULL;
+        conn->priv.flags&=~HFL_COMPRESS;
+    }
 }
+#endif
 
 //Function to send any data in conn->priv.sendBuff. Do not use in CGIs unless you know what you
 //are doing! Also, if you do set conn->cgi to NULL to indicate the connection is closed, do it BEFORE
 //calling this.
 void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn)
 {
-    int r, len;
+    int len;
+    int start=0; //offset of the first byte to send, past any unused room at the start
+    bool chunked;
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    //The worker running an offloaded cgi owns the buffer; it's sent once the cgi is back.
+    if (conn->priv.offloaded) return;
+#endif
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+    if (conn->priv.flags&HFL_COMPRESSPENDING) start=httpdStartCompression(pInstance, conn);
+    if (conn->priv.flags&HFL_COMPRESS) {
+        httpdFlushCompressed(pInstance, conn, start);
+        conn->priv.sendBuffLen=0;
+        return;
+    }
+#endif
     if (conn->priv.chunkHdr!=NULL) {
         //We're sending chunked data, and the chunk needs fixing up.
+        char hdr[CHUNK_HDR_MAX_LEN+1];
+        int hdrLen, gap;
         //Finish chunk with cr/lf
         if(conn->priv.sendBuffLen + 2 <= HTTPD_SENDBUFF_SIZE) {
             // Add chunk closing.
@@ -406,16 +1144,30 @@ void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnD
         //Calculate length of chunk
         // +2 is to remove the two characters written above via httpdSend(), those
         // bytes aren't counted in the chunk length
-        len=((&conn->priv.sendBuff[conn->priv.sendBuffLen])-conn->priv.chunkHdr) - (CHUNK_SIZE_TEXT_LEN + 2);
-        //Fix up chunk header to correct value
-        conn->priv.chunkHdr[0]=httpdHexNibble(len>>12);
-        conn->priv.chunkHdr[1]=httpdHexNibble(len>>8);
-        conn->priv.chunkHdr[2]=httpdHexNibble(len>>4);
-        conn->priv.chunkHdr[3]=httpdHexNibble(len>>0);
+        len=((&conn->priv.sendBuff[conn->priv.sendBuffLen])-conn->priv.chunkHdr) - (CHUNK_HDR_MAX_LEN + 2);
+        //Write the size line right before the chunk data, then slide whatever precedes the
+        //chunk (normally the response headers) up against it. The unused part of the
+        //reservation ends up at the start of the buffer, and is skipped when sending.
+        hdrLen=snprintf(hdr, sizeof(hdr), "%X\r\n", len);
+        gap=CHUNK_HDR_MAX_LEN-hdrLen;
+        memcpy(conn->priv.chunkHdr+gap, hdr, hdrLen);
+        if (gap>0 && conn->priv.chunkHdr>conn->priv.sendBuff+start) {
+            memmove(conn->priv.sendBuff+start+gap, conn->priv.sendBuff+start, conn->priv.chunkHdr-(conn->priv.sendBuff+start));
+        }
+        start+=gap;
         //Reset chunk hdr for next call
         conn->priv.chunkHdr=NULL;
     }
-    if (conn->priv.flags&HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY && conn->cgi==NULL) {
+    chunked=(conn->priv.flags&HFL_CHUNKED) && (conn->priv.flags&HFL_SENDINGBODY) && !(conn->priv.flags&HFL_CONTENTLEN);
+    if (chunked && conn->priv.sendRef!=NULL && conn->priv.sendRefTrailer==NULL) {
+        //Data sent by reference is a chunk of its own, right after the buffer. Its end, and
+        //the end of the body if the cgi is done, go out after it.
+        char hdr[CHUNK_HDR_MAX_LEN+1];
+        int hdrLen=snprintf(hdr, sizeof(hdr), "%X\r\n", conn->priv.sendRefLen);
+        memcpy(&conn->priv.sendBuff[conn->priv.sendBuffLen], hdr, hdrLen);
+        conn->priv.sendBuffLen+=hdrLen;
+        conn->priv.sendRefTrailer=(conn->cgi==NULL)?"\r\n0\r\n\r\n":"\r\n";
+    } else if (chunked && conn->cgi==NULL && conn->priv.sendRef==NULL) {
         if(conn->priv.sendBuffLen + 5 <= HTTPD_SENDBUFF_SIZE)
         {
             //Connection finished sending whatever needs to be sent. Add NULL chunk to indicate this.
@@ -427,44 +1179,23 @@ void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnD
             ESP_LOGE(TAG, "sendBuff full");
         }
     }
-    if (conn->priv.sendBuffLen!=0)
-    {
-        r = httpdPlatSendData(pInstance, conn, conn->priv.sendBuff, conn->priv.sendBuffLen);
-        if (r != conn->priv.sendBuffLen) {
-#ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
-            //Can't send this for some reason. Dump packet in backlog, we can send it later.
-            if (conn->priv.sendBacklogSize+conn->priv.sendBuffLen>HTTPD_MAX_BACKLOG_SIZE) {
-                ESP_LOGE(TAG, "Backlog: Exceeded max backlog size, dropped %d bytes", conn->priv.sendBuffLen);
-                conn->priv.sendBuffLen=0;
-                return;
-            }
-            HttpSendBacklogItem *i=malloc(sizeof(HttpSendBacklogItem)+conn->priv.sendBuffLen);
-            if (i==NULL) {
-                ESP_LOGE(TAG, "Backlog: malloc failed");
-                return;
-            }
-            memcpy(i->data, conn->priv.sendBuff, conn->priv.sendBuffLen);
-            i->len=conn->priv.sendBuffLen;
-            i->next=NULL;
-            if (conn->priv.sendBacklog==NULL) {
-                conn->priv.sendBacklog=i;
-            } else {
-                HttpSendBacklogItem *e=conn->priv.sendBacklog;
-                while (e->next!=NULL) e=e->next;
-                e->next=i;
-            }
-            conn->priv.sendBacklogSize+=conn->priv.sendBuffLen;
-#else
-            ESP_LOGE(TAG, "send buf tried to write %d bytes, wrote %d", conn->priv.sendBuffLen, r);
-#endif
-        }
-        conn->priv.sendBuffLen=0;
-    }
+    httpdSendOut(pInstance, conn, conn->priv.sendBuff+start, conn->priv.sendBuffLen-start);
+    conn->priv.sendBuffLen=0;
+    if (conn->priv.sendRef!=NULL) httpdSendRefSegment(pInstance, conn);
 }
 
 void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdInstance *pInstance, HttpdConnData *conn) {
     conn->cgi=NULL; //no need to call this anymore
 
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+    //The copy of the response is complete, later requests can be answered with it.
+    if (conn->priv.cacheFill!=NULL && (conn->priv.flags&HFL_SENDINGBODY)) {
+        httpdCachePut(pInstance, conn->priv.cacheFill);
+        conn->priv.cacheFill=NULL;
+    }
+    httpdCacheAbandon(conn);
+#endif
+
     if (conn->priv.flags&HFL_CHUNKED)
     {
         ESP_LOGD(TAG, "cleaning up");
@@ -473,6 +1204,7 @@ void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdInstance *pInstance, HttpdConnData *c
         conn->priv.headPos=0;
         conn->post.len=-1;
         conn->priv.flags=0;
+        conn->priv.routeOpts=NULL;
         if (conn->post.buff) free(conn->post.buff);
         conn->post.buff=NULL;
         conn->post.buffLen=0;
@@ -484,6 +1216,108 @@ void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdInstance *pInstance, HttpdConnData *c
     }
 }
 
+//If the cgi suspended the connection, the server leaves it alone until httpdResume(), unless
+//that was called while the cgi ran.
+static void ICACHE_FLASH_ATTR httpdNoteSuspend(HttpdInstance *pInstance, HttpdConnData *conn, CgiStatus r) {
+    if (r!=HTTPD_CGI_SUSPEND) return;
+    if (conn->priv.resumePending) {
+        conn->priv.resumePending=false;
+        httpdPlatResume(pInstance, conn);
+    } else {
+        conn->priv.flags|=HFL_SUSPENDED;
+    }
+}
+
+//Calls the cgi, or hands the call to a worker task if its route asks for that. An offloaded
+//call looks like a suspend to the caller.
+static CgiStatus ICACHE_FLASH_ATTR httpdCallCgi(HttpdInstance *pInstance, HttpdConnData *conn) {
+    CgiStatus r;
+    conn->priv.flags&=~HFL_SUSPENDED;
+    conn->priv.resumePending=false;
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    if (conn->priv.flags&HFL_OFFLOAD) {
+        conn->priv.offloaded=true;
+        if (httpdPlatOffload(pInstance, conn)) return HTTPD_CGI_SUSPEND;
+        conn->priv.offloaded=false;
+        ESP_LOGW(TAG, "offload queue full, running cgi for %s here", conn->url);
+    }
+#endif
+    r=conn->cgi(conn);
+    httpdNoteSuspend(pInstance, conn, r);
+    return r;
+}
+
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+//Keeps data that came in while the cgi is offloaded, to be handled once it's back.
+static bool ICACHE_FLASH_ATTR httpdStashRecv(HttpdConnData *conn, const char *data, int len) {
+    char *p=realloc(conn->priv.recvStash, conn->priv.recvStashLen+len);
+    if (p==NULL) return false;
+    memcpy(p+conn->priv.recvStashLen, data, len);
+    conn->priv.recvStash=p;
+    conn->priv.recvStashLen+=len;
+    return true;
+}
+
+static void httpdRouteRequest(HttpdInstance *pInstance, HttpdConnData *conn, int i);
+
+//Handles the data that came in while the cgi was offloaded. Returns false if the connection
+//should be closed.
+static bool ICACHE_FLASH_ATTR httpdReplayStash(HttpdInstance *pInstance, HttpdConnData *conn) {
+    char *stash=conn->priv.recvStash;
+    bool ok=true;
+    if (stash==NULL) return true;
+    conn->priv.recvStash=NULL;
+    ok=(httpdRecvCb(pInstance, conn, stash, conn->priv.recvStashLen)==CallbackSuccess);
+    conn->priv.recvStashLen=0;
+    free(stash);
+    return ok;
+}
+
+//Called from a worker task for a connection whose cgi call was offloaded. The server task keeps
+//its hands off the connection until the call is over, so the cgi runs without the server lock
+//and can block as long as it likes. Its output goes out once it returns.
+void ICACHE_FLASH_ATTR httpdOffloadRun(HttpdInstance *pInstance, HttpdConnData *conn) {
+    CgiStatus r;
+
+    r=conn->cgi(conn);
+
+    httpdPlatLock(pInstance);
+    conn->priv.offloaded=false;
+    httpdNoteSuspend(pInstance, conn, r);
+    if ((r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) && conn->priv.offloadRoute>0) {
+        //Passed on the request. The server task goes on with the next route, with the same
+        //chunk of POST data and anything that came in meanwhile, see httpdContinue().
+        conn->priv.reroute=true;
+        httpdPlatOffloadDone(pInstance, conn);
+        httpdPlatUnlock(pInstance);
+        return;
+    }
+    conn->priv.offloadRoute=0;
+    if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
+        ESP_LOGE(TAG, "offloaded CGI fn returned %d", r);
+    }
+    if (r==HTTPD_CGI_DONE || r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
+        httpdCgiIsDone(pInstance, conn);
+    }
+    conn->post.buffLen=0; //done with the chunk of POST data, if it was called for one
+    httpdFlushSendBuffer(pInstance, conn);
+    httpdPlatOffloadDone(pInstance, conn);
+    if (!httpdReplayStash(pInstance, conn)) httpdPlatDisconnect(conn);
+    httpdPlatUnlock(pInstance);
+}
+#endif
+
+void ICACHE_FLASH_ATTR httpdResume(HttpdInstance *pInstance, HttpdConnData *conn) {
+    httpdPlatLock(pInstance);
+    if (conn->priv.flags&HFL_SUSPENDED) {
+        conn->priv.flags&=~HFL_SUSPENDED;
+        httpdPlatResume(pInstance, conn);
+    } else if (conn->cgi!=NULL) {
+        conn->priv.resumePending=true;
+    }
+    httpdPlatUnlock(pInstance);
+}
+
 //Callback called when the data on a socket has been successfully
 //sent.
 CallbackStatus ICACHE_FLASH_ATTR httpdSentCb(HttpdInstance *pInstance, HttpdConnData *pConn) {
@@ -493,15 +1327,36 @@ CallbackStatus ICACHE_FLASH_ATTR httpdSentCb(HttpdInstance *pInstance, HttpdConn
 //Can be called after a CGI function has returned HTTPD_CGI_MORE to
 //resume handling an open connection asynchronously
 CallbackStatus ICACHE_FLASH_ATTR httpdContinue(HttpdInstance *pInstance, HttpdConnData * conn) {
-    int r;
+    int r, len;
     httpdPlatLock(pInstance);
     CallbackStatus status = CallbackSuccess;
 
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    if (conn->priv.offloaded) {
+        //The worker owns the connection, this waits for it to be done.
+        httpdPlatUnlock(pInstance);
+        return CallbackSuccess;
+    }
+    if (conn->priv.reroute) {
+        //An offloaded cgi passed on the request; carry on with the route walk here.
+        conn->priv.reroute=false;
+        len=conn->priv.offloadRoute;
+        conn->priv.offloadRoute=0;
+        httpdRouteRequest(pInstance, conn, len);
+        if (!conn->priv.offloaded) {
+            conn->post.buffLen=0;
+            if (!httpdReplayStash(pInstance, conn)) status=CallbackError;
+        }
+        httpdPlatUnlock(pInstance);
+        return status;
+    }
+#endif
+
 #ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
     if (conn->priv.sendBacklog!=NULL) {
         //We have some backlog to send first.
         HttpSendBacklogItem *next=conn->priv.sendBacklog->next;
-        int bytesWritten = httpdPlatSendData(pInstance, conn->conn, conn->priv.sendBacklog->data, conn->priv.sendBacklog->len);
+        int bytesWritten = httpdPlatSendData(pInstance, conn, conn->priv.sendBacklog->data, conn->priv.sendBacklog->len);
         if(bytesWritten != conn->priv.sendBacklog->len)
         {
             ESP_LOGE(TAG, "tried to write %d bytes, wrote %d", conn->priv.sendBacklog->len, bytesWritten);
@@ -514,6 +1369,13 @@ CallbackStatus ICACHE_FLASH_ATTR httpdContinue(HttpdInstance *pInstance, HttpdCo
     }
 #endif
 
+    if (conn->priv.sendRef!=NULL) {
+        //Data the cgi sent by reference goes out before it's called again.
+        httpdSendRefSegment(pInstance, conn);
+        httpdPlatUnlock(pInstance);
+        return CallbackSuccess;
+    }
+
     if (conn->priv.flags & HFL_DISCONAFTERSENT) { //Marked for destruction?
         ESP_LOGD(TAG, "closing");
         httpdPlatDisconnect(conn);
@@ -522,14 +1384,23 @@ CallbackStatus ICACHE_FLASH_ATTR httpdContinue(HttpdInstance *pInstance, HttpdCo
     } else
     {
         //If we don't have a CGI function, there's nothing to do but wait for something from the client.
-        if (conn->cgi == NULL)
+        //Same for a suspended one until it's resumed.
+        if (conn->cgi == NULL || (conn->priv.flags & HFL_SUSPENDED))
         {
             status = CallbackSuccess;
         } else
         {
             conn->priv.sendBuffLen = 0;
 
-            r = conn->cgi(conn); //Execute cgi fn.
+            //Execute cgi fn. If it sizes its output to the room left, call it again as long
+            //as it keeps producing data and the send buffer has plenty of room left, so its
+            //output goes out as one big chunk and one write instead of many small ones.
+            do {
+                len = conn->priv.sendBuffLen;
+                r = httpdCallCgi(pInstance, conn);
+            } while (r == HTTPD_CGI_MORE && httpdCgiCoalesces(conn) && conn->priv.sendBuffLen > len &&
+                     conn->priv.sendRef == NULL &&
+                     HTTPD_SENDBUFF_MAX_FILL - conn->priv.sendBuffLen >= HTTPD_CGI_COALESCE_MIN_FREE);
 
             if (r==HTTPD_CGI_DONE)
             {
@@ -553,61 +1424,187 @@ CallbackStatus ICACHE_FLASH_ATTR httpdContinue(HttpdInstance *pInstance, HttpdCo
     return status;
 }
 
-//This is called when the headers have been received and the connection is ready to send
-//the result headers and data.
-//We need to find the CGI function to call, call it, and dependent on what it returns either
-//find the next cgi function, wait till the cgi data is sent or close up the connection.
-static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdInstance *pInstance, HttpdConnData *conn) {
-    int r;
-    int i=0;
-    if (conn->url==NULL)
-    {
-        ESP_LOGE(TAG, "url = NULL");
-        return; //Shouldn't happen
+//Returns true if the route pattern matches the url: either literally, or up to the '*' if
+//the route ends in one.
+static bool ICACHE_FLASH_ATTR httpdRouteMatches(const char *route, const char *url) {
+    size_t len;
+    if (strcmp(route, url)==0) return true;
+    len=strlen(route);
+    return len>0 && route[len-1]=='*' && strncmp(route, url, len-1)==0;
+}
+
+//Make the cgi of a route the one handling the connection.
+static void ICACHE_FLASH_ATTR httpdSelectRoute(HttpdConnData *conn, const HttpdBuiltInUrl *pUrl) {
+    conn->route=pUrl->url;
+    conn->cgiData=NULL;
+    conn->cgi=pUrl->cgiCb;
+    conn->cgiArg=pUrl->cgiArg;
+    conn->cgiArg2=pUrl->cgiArg2;
+    if (pUrl->opts!=NULL && pUrl->opts->offload) {
+        conn->priv.flags|=HFL_OFFLOAD;
+    } else {
+        conn->priv.flags&=~HFL_OFFLOAD;
     }
+}
 
-#ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
-    // CORS preflight, allow the token we received before
-    if (conn->requestType == HTTPD_METHOD_OPTIONS)
-    {
-        httpdStartResponse(conn, 200);
-        httpdHeader(conn, "Access-Control-Allow-Headers", conn->priv.corsToken);
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+//Sends a response from the cache instead of calling the cgi of the route. cgiArg is the
+//entry, cgiData where the rest of the body starts.
+static CgiStatus ICACHE_FLASH_ATTR httpdServeCached(HttpdConnData *conn) {
+    HttpdCacheEntry *e=(HttpdCacheEntry *)conn->cgiArg;
+    char *p=conn->cgiData;
+    char *end=e->data+e->len;
+
+    if (conn->isConnectionClosed) {
+        httpdCacheRelease(e);
+        return HTTPD_CGI_DONE;
+    }
+    if (p==NULL) {
+        //The length is known, so it can go out unchunked; unless it's compressed on the way.
+        if (conn->priv.routeOpts==NULL || !conn->priv.routeOpts->compress) {
+            httpdSetContentLength(conn, e->len-e->hdrLen);
+        }
+        httpdStartResponse(conn, e->code);
+        httpdSend(conn, e->data, e->hdrLen);
+        conn->priv.flags|=e->flags;
         httpdEndHeaders(conn);
-        httpdCgiIsDone(pInstance, conn);
+        p=e->data+e->hdrLen;
+    }
+    p+=httpdSendPartial(conn, p, end-p);
+    if (p<end) {
+        conn->cgiData=p;
+        return HTTPD_CGI_MORE;
+    }
+    httpdCacheRelease(e);
+    return HTTPD_CGI_DONE;
+}
 
-        ESP_LOGD(TAG, "CORS preflight resp sent");
+//For GET requests to a route with a cacheTtlMs: answers from the cache if there's a fresh
+//response for the url and arguments, otherwise has a copy kept of the one the cgi makes.
+static void ICACHE_FLASH_ATTR httpdCacheSelect(HttpdInstance *pInstance, HttpdConnData *conn, const HttpdBuiltInUrl *pUrl) {
+    char key[HTTPD_CACHE_KEY_LEN];
+    HttpdCacheEntry *e;
+
+    httpdCacheAbandon(conn); //of an earlier route that passed on the request
+    if (pUrl->opts==NULL || pUrl->opts->cacheTtlMs<=0 || conn->requestType!=HTTPD_METHOD_GET) return;
+    if (!httpdCacheMakeKey(conn->url, conn->getArgs, key, sizeof(key))) return;
+    e=httpdCacheGet(pInstance, key);
+    if (e!=NULL) {
+        ESP_LOGD(TAG, "%s from cache", key);
+        conn->cgi=httpdServeCached;
+        conn->cgiArg=e;
+        conn->priv.flags&=~HFL_OFFLOAD;
         return;
     }
+    conn->priv.cacheFill=httpdCacheNew(pUrl->url, key, pUrl->opts->cacheTtlMs);
+}
 #endif
 
+//Sends a short plain text error response and closes the connection once it's out. Anything
+//the client still sends for this request is ignored.
+static void ICACHE_FLASH_ATTR httpdSendErrorAndClose(HttpdInstance *pInstance, HttpdConnData *conn, int code, const char *msg) {
+    httpdSetTransferMode(conn, HTTPD_TRANSFER_CLOSE);
+    httpdStartResponse(conn, code);
+    httpdHeader(conn, "Content-Type", "text/plain");
+    httpdEndHeaders(conn);
+    httpdSend(conn, msg, -1);
+    conn->priv.flags|=HFL_DISCARDBODY;
+    httpdCgiIsDone(pInstance, conn);
+}
+
+//Returns the options of the first route matching the url that has any.
+static const HttpdRouteOpts ICACHE_FLASH_ATTR *httpdFindRouteOpts(HttpdInstance *pInstance, const char *url) {
+    const HttpdBuiltInUrl *pUrl;
+    for (pUrl=pInstance->builtInUrls; pUrl->url!=NULL; pUrl++) {
+        if (pUrl->opts!=NULL && httpdRouteMatches(pUrl->url, url)) return pUrl->opts;
+    }
+    return NULL;
+}
+
+//Checks a request whose head is complete against the limits of its route. Sends the error
+//response and returns false if the request is rejected.
+static bool ICACHE_FLASH_ATTR httpdCheckLimits(HttpdInstance *pInstance, HttpdConnData *conn, bool badRequest) {
+    const HttpdRouteOpts *opts;
+    size_t urlLen;
+
+    if (badRequest || conn->url==NULL) {
+        httpdSendErrorAndClose(pInstance, conn, 400, "400 Bad request.");
+        return false;
+    }
+    opts=httpdFindRouteOpts(pInstance, conn->url);
+    conn->priv.routeOpts=opts;
+    if (opts==NULL) return true;
+
+    urlLen=strlen(conn->url);
+    if (conn->getArgs!=NULL) urlLen+=strlen(conn->getArgs)+1;
+    if (opts->maxUrlLen>0 && urlLen>opts->maxUrlLen) {
+        ESP_LOGE(TAG, "url too long for %s", conn->url);
+        httpdSendErrorAndClose(pInstance, conn, 414, "414 URI too long.");
+        return false;
+    }
+    if (opts->maxHeadLen>0 && conn->priv.headPos>opts->maxHeadLen) {
+        ESP_LOGE(TAG, "head too long for %s", conn->url);
+        httpdSendErrorAndClose(pInstance, conn, 431, "431 Request header fields too large.");
+        return false;
+    }
+    if (opts->maxBodyLen>0 && conn->post.len>opts->maxBodyLen) {
+        ESP_LOGE(TAG, "body of %d bytes too large for %s", conn->post.len, conn->url);
+        httpdSendErrorAndClose(pInstance, conn, 413, "413 Content too large.");
+        return false;
+    }
+    return true;
+}
+
+//Called when the head of a request with 'Expect: 100-continue' is in, before the client sends
+//the body. Runs the authentication cgis in front of the route chain for the url, so a client
+//that is going to be rejected is told right away instead of after uploading the body. Otherwise
+//the client is told to go ahead.
+static void ICACHE_FLASH_ATTR httpdHandleExpectContinue(HttpdInstance *pInstance, HttpdConnData *conn) {
+    const HttpdBuiltInUrl *pUrl;
+    int flags=conn->priv.flags;
+    bool matched=false;
+    bool rejected=false;
+
+    //A rejection closes the connection, the client may send the body regardless.
+    httpdSetTransferMode(conn, HTTPD_TRANSFER_CLOSE);
+    for (pUrl=pInstance->builtInUrls; pUrl->url!=NULL && !rejected; pUrl++) {
+        if (!httpdRouteMatches(pUrl->url, conn->url)) continue;
+        matched=true;
+        if (pUrl->cgiCb!=authBasic) break; //the rest of the chain gets to see the body first
+        httpdSelectRoute(conn, pUrl);
+        rejected=(authBasic(conn)!=HTTPD_CGI_AUTHENTICATED);
+    }
+    if (!matched) {
+        ESP_LOGD(TAG, "%s not found. 404", conn->url);
+        httpdSendErrorAndClose(pInstance, conn, 404, "404 File not found.");
+    } else if (rejected) {
+        ESP_LOGD(TAG, "rejected %s before receiving the body", conn->url);
+        conn->priv.flags|=HFL_DISCARDBODY;
+        httpdCgiIsDone(pInstance, conn);
+    } else {
+        conn->priv.flags=flags;
+        conn->cgi=NULL; //httpdProcessRequest picks the cgi once the body starts coming in
+        httpdSend(conn, "HTTP/1.1 100 Continue\r\n\r\n", -1);
+    }
+}
+
+//Walks the routes from index i on, calling the cgi of each that matches the url until one
+//handles the request.
+static void ICACHE_FLASH_ATTR httpdRouteRequest(HttpdInstance *pInstance, HttpdConnData *conn, int i) {
+    int r;
+
     //See if we can find a CGI that's happy to handle the request.
     while (1)
     {
         //Look up URL in the built-in URL table.
         while (pInstance->builtInUrls[i].url!=NULL) {
             const HttpdBuiltInUrl *pUrl = &(pInstance->builtInUrls[i]);
-            bool match = false;
-            const char* route = pUrl->url;
-
-            //See if there's a literal match
-            if (strcmp(route, conn->url)==0)
-            {
-                match = true;
-            } else if(route[strlen(route)-1]=='*' &&
-                        strncmp(route, conn->url, strlen(route)-1)==0)
-            {
-                // See if there's a wildcard match, if the route entry ends in '*'
-                // and everything up to the '*' is a match
-                match = true;
-            }
-
-            if (match) {
+            if (httpdRouteMatches(pUrl->url, conn->url)) {
                 ESP_LOGD(TAG, "Is url index %d", i);
-                conn->route=route;
-                conn->cgiData=NULL;
-                conn->cgi=pUrl->cgiCb;
-                conn->cgiArg=pUrl->cgiArg;
-                conn->cgiArg2=pUrl->cgiArg2;
+                httpdSelectRoute(conn, pUrl);
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+                httpdCacheSelect(pInstance, conn, pUrl);
+#endif
                 break;
             }
             i++;
@@ -621,9 +1618,15 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdInstance *pInstance, Http
 
         //Okay, we have a CGI function that matches the URL. See if it wants to handle the
         //particular URL we're supposed to handle.
-        r=conn->cgi(conn);
-        if (r==HTTPD_CGI_MORE) {
-            //Yep, it's happy to do so and has more data to send.
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+        conn->priv.offloadRoute=i+1; //where the walk goes on if it's offloaded and passes
+#endif
+        r=httpdCallCgi(pInstance, conn);
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+        if (!conn->priv.offloaded) conn->priv.offloadRoute=0;
+#endif
+        if (r==HTTPD_CGI_MORE || r==HTTPD_CGI_SUSPEND) {
+            //Yep, it's happy to do so and has more data to send, now or once resumed.
             if (conn->recvHdl) {
                 //Seems the CGI is planning to do some long-term communications with the socket.
                 //Disable the timeout on it, so we won't run into that.
@@ -643,6 +1646,34 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdInstance *pInstance, Http
     }
 }
 
+//This is called when the headers have been received and the connection is ready to send
+//the result headers and data.
+//We need to find the CGI function to call, call it, and dependent on what it returns either
+//find the next cgi function, wait till the cgi data is sent or close up the connection.
+static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdInstance *pInstance, HttpdConnData *conn) {
+    if (conn->url==NULL)
+    {
+        ESP_LOGE(TAG, "url = NULL");
+        return; //Shouldn't happen
+    }
+
+#ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
+    // CORS preflight, allow the token we received before
+    if (conn->requestType == HTTPD_METHOD_OPTIONS)
+    {
+        httpdStartResponse(conn, 200);
+        httpdHeader(conn, "Access-Control-Allow-Headers", conn->priv.corsToken);
+        httpdEndHeaders(conn);
+        httpdCgiIsDone(pInstance, conn);
+
+        ESP_LOGD(TAG, "CORS preflight resp sent");
+        return;
+    }
+#endif
+
+    httpdRouteRequest(pInstance, conn, 0);
+}
+
 //Parse a line of header data and modify the connection data accordingly.
 static CallbackStatus ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     int i;
@@ -719,29 +1750,20 @@ static CallbackStatus ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData
         while (h[i]==' ') i++;
         if (strncmp(&h[i], "close", 5)==0) conn->priv.flags&=~HFL_CHUNKED; //Don't use chunked conn
     } else if (strncasecmp(h, "Content-Length:", 15)==0) {
+        char *end;
+        long len;
         i=15;
         //Skip trailing spaces
         while (h[i]==' ') i++;
-        //Get POST data length
-        conn->post.len=atoi(h+i);
-
-        // Allocate the buffer
-        if (conn->post.len > HTTPD_MAX_POST_LEN) {
-            // we'll stream this in in chunks
-            conn->post.buffSize = HTTPD_MAX_POST_LEN;
+        //Get POST data length. The body buffer is only allocated once the whole head is in
+        //and the request has passed the limits of its route.
+        len=strtol(h+i, &end, 10);
+        while (*end==' ') end++;
+        if (end==h+i || *end!=0 || len<0) {
+            ESP_LOGE(TAG, "bad Content-Length: %s", h+i);
+            status = CallbackError;
         } else {
-            conn->post.buffSize = conn->post.len;
-        }
-
-        ESP_LOGD(TAG, "Mallocced buffer for %d + 1 bytes of post data", conn->post.buffSize);
-        int bufferSize = conn->post.buffSize + 1;
-        conn->post.buff=(char*)malloc(bufferSize);
-        if (conn->post.buff==NULL) {
-            ESP_LOGE(TAG, "malloc failed %d bytes", bufferSize);
-            status = CallbackErrorMemory;
-        } else
-        {
-            conn->post.buffLen=0;
+            conn->post.len=(len>INT_MAX)?INT_MAX:len;
         }
     } else if (strncasecmp(h, "Content-Type: ", 14)==0) {
         if (strstr(h, "multipart/form-data")) {
@@ -771,6 +1793,27 @@ static CallbackStatus ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData
     return status;
 }
 
+//Allocate the buffer the body of a request is received in. Bodies larger than
+//HTTPD_MAX_POST_LEN are streamed through it in pieces.
+static bool ICACHE_FLASH_ATTR httpdAllocPostBuff(HttpdConnData *conn) {
+    if (conn->post.len > HTTPD_MAX_POST_LEN) {
+        // we'll stream this in in chunks
+        conn->post.buffSize = HTTPD_MAX_POST_LEN;
+    } else {
+        conn->post.buffSize = conn->post.len;
+    }
+
+    ESP_LOGD(TAG, "Mallocced buffer for %d + 1 bytes of post data", conn->post.buffSize);
+    int bufferSize = conn->post.buffSize + 1;
+    conn->post.buff=(char*)malloc(bufferSize);
+    if (conn->post.buff==NULL) {
+        ESP_LOGE(TAG, "malloc failed %d bytes", bufferSize);
+        return false;
+    }
+    conn->post.buffLen=0;
+    return true;
+}
+
 //Make a connection 'live' so we can do all the things a cgi can do to it.
 //ToDo: Also make httpdRecvCb/httpdContinue use these?
 CallbackStatus ICACHE_FLASH_ATTR httpdConnSendStart(HttpdInstance *pInstance, HttpdConnData *conn) {
@@ -793,9 +1836,19 @@ void ICACHE_FLASH_ATTR httpdConnSendFinish(HttpdInstance *pInstance, HttpdConnDa
 CallbackStatus ICACHE_FLASH_ATTR httpdRecvCb(HttpdInstance *pInstance, HttpdConnData *conn, char *data, unsigned short len) {
     int x, r;
     char *p, *e;
+    char expect[16];
     CallbackStatus status = CallbackSuccess;
     httpdPlatLock(pInstance);
 
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+    if (conn->priv.offloaded || conn->priv.reroute) {
+        //The worker owns the connection, this waits for it to be done.
+        if (!httpdStashRecv(conn, data, len)) status=CallbackErrorMemory;
+        httpdPlatUnlock(pInstance);
+        return status;
+    }
+#endif
+
     conn->priv.sendBuffLen=0;
 #ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
     conn->priv.corsToken[0] = 0;
@@ -809,40 +1862,46 @@ CallbackStatus ICACHE_FLASH_ATTR httpdRecvCb(HttpdInstance *pInstance, HttpdConn
 
     for (x=0; x<len; x++)
     {
-        if (conn->post.len<0) // This byte is a header byte
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+        if (conn->priv.offloaded) {
+            //The cgi just went to a worker, the rest of the data waits for it to be back.
+            if (!httpdStashRecv(conn, data+x, len-x)) status=CallbackErrorMemory;
+            break;
+        }
+#endif
+        if (conn->priv.flags&HFL_DISCARDBODY) {
+            //Rest of a request that was already rejected, the connection is closed once the
+            //response is out.
+            break;
+        } else if (conn->post.len<0) // This byte is a header byte
         {
-            if (data[x]=='\n')
+            //Keep room for the \r faked in front of a bare \n, and the terminating 0
+            if (conn->priv.headPos >= HTTPD_MAX_HEAD_LEN-2)
             {
-                if(conn->priv.headPos < HTTPD_MAX_HEAD_LEN-1)
-                {
-                    //Compatibility with clients that send \n only: fake a \r in front of this.
-                    if (conn->priv.headPos!=0 && conn->priv.head[conn->priv.headPos-1]!='\r') {
-                        conn->priv.head[conn->priv.headPos++]='\r';
-                    }
-                } else
-                {
-                    ESP_LOGE(TAG, "adding newline request too long");
-                    status = CallbackErrorMemory;
-                    break;
+                ESP_LOGE(TAG, "request too long!");
+                if (strstr(conn->priv.head, "\r\n")==NULL) {
+                    httpdSendErrorAndClose(pInstance, conn, 414, "414 URI too long.");
+                } else {
+                    httpdSendErrorAndClose(pInstance, conn, 431, "431 Request header fields too large.");
                 }
+                break;
             }
 
-            //ToDo: return http error code 431 (request header too long) if this happens
-            if (conn->priv.headPos < HTTPD_MAX_HEAD_LEN-1)
-            {
-                conn->priv.head[conn->priv.headPos++]=data[x];
-            } else
+            if (data[x]=='\n')
             {
-                ESP_LOGE(TAG, "request too long!");
-                status = CallbackErrorMemory;
-                break;
+                //Compatibility with clients that send \n only: fake a \r in front of this.
+                if (conn->priv.headPos!=0 && conn->priv.head[conn->priv.headPos-1]!='\r') {
+                    conn->priv.head[conn->priv.headPos++]='\r';
+                }
             }
+            conn->priv.head[conn->priv.headPos++]=data[x];
 
             // always null terminate
             conn->priv.head[conn->priv.headPos]=0;
 
             //Scan for /r/n/r/n. Receiving this indicate the headers end.
             if (data[x]=='\n' && (char *)strstr(conn->priv.head, "\r\n\r\n")!=NULL) {
+                bool badRequest=false;
                 //Indicate we're done with the headers.
                 conn->post.len=0;
                 //Reset url data
@@ -853,12 +1912,25 @@ CallbackStatus ICACHE_FLASH_ATTR httpdRecvCb(HttpdInstance *pInstance, HttpdConn
                     e=(char *)strstr(p, "\r\n"); //Find end of header line
                     if (e==NULL) break;			//Shouldn't happen.
                     e[0]=0;						//Zero-terminate header
-                    httpdParseHeader(p, conn);	//and parse it.
+                    if (httpdParseHeader(p, conn)!=CallbackSuccess) badRequest=true; //and parse it.
                     p=e+2;						//Skip /r/n (now /0/n)
                 }
-                //If we don't need to receive post data, we can send the response now.
-                if (conn->post.len==0) {
+                if (!httpdCheckLimits(pInstance, conn, badRequest)) {
+                    //Rejected, error response is on its way.
+                } else if (conn->post.len==0) {
+                    //If we don't need to receive post data, we can send the response now.
                     httpdProcessRequest(pInstance, conn);
+                } else {
+                    //A request rejected before the client sends the body doesn't need a buffer for it
+                    if ((conn->priv.flags&HFL_HTTP11) &&
+                            httpdGetHeader(conn, "Expect", expect, sizeof(expect)) &&
+                            strcasecmp(expect, "100-continue")==0) {
+                        httpdHandleExpectContinue(pInstance, conn);
+                    }
+                    if (!(conn->priv.flags&HFL_DISCARDBODY) && !httpdAllocPostBuff(conn)) {
+                        status = CallbackErrorMemory;
+                        break;
+                    }
                 }
             }
         } else if (conn->post.buff && conn->post.len!=0) {
@@ -871,7 +1943,7 @@ CallbackStatus ICACHE_FLASH_ATTR httpdRecvCb(HttpdInstance *pInstance, HttpdConn
                 conn->post.buff[conn->post.buffLen]=0; //zero-terminate, in case the cgi handler knows it can use strings
                 //Process the data
                 if (conn->cgi) {
-                    r=conn->cgi(conn);
+                    r=httpdCallCgi(pInstance, conn);
                     if (r==HTTPD_CGI_DONE) {
                         httpdCgiIsDone(pInstance, conn);
                     }
@@ -880,6 +1952,10 @@ CallbackStatus ICACHE_FLASH_ATTR httpdRecvCb(HttpdInstance *pInstance, HttpdConn
                     //call it the first time.
                     httpdProcessRequest(pInstance, conn);
                 }
+                //An offloaded cgi is still reading the chunk; it's reset when the cgi is back.
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+                if (!conn->priv.offloaded)
+#endif
                 conn->post.buffLen = 0;
             }
         } else {
@@ -924,6 +2000,7 @@ void ICACHE_FLASH_ATTR httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *p
     httpdPlatLock(pInstance);
 
     memset(pConn, 0, sizeof(HttpdConnData));
+    pConn->pInstance=pInstance;
     pConn->post.len=-1;
 
     httpdPlatUnlock(pInstance);
@@ -0,0 +1,67 @@
+#ifndef CGISSE_H
+#define CGISSE_H
+
+#include "httpd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Sse Sse;
+typedef struct SseRoute SseRoute;
+
+/**
+ * Called when a client subscribes.
+ * @param lastEventId id of the last event a reconnecting client saw, NULL for a new client
+ */
+typedef void(*SseConnectedCb)(Sse *sse, const char *lastEventId);
+typedef void(*SseCloseCb)(Sse *sse);
+
+struct Sse {
+	void *userData; // optional user data to attach to a Sse object, not used by the library
+	HttpdConnData *conn; // The connection of the subscriber, NULL once httpdSseClose() is called on it
+	SseRoute *route; // The route subscribed to
+	SseCloseCb closeCb; // optional user callback on the subscriber going away. The Sse is freed once it returns.
+	Sse *next; // Next subscriber of the route
+};
+
+/**
+ * An event stream endpoint, see ROUTE_SSE(). Declare one per route, initialised with
+ * SSE_ROUTE_INIT(); it holds the subscribers, so it belongs to one server instance.
+ */
+struct SseRoute {
+	SseConnectedCb connectedCb; // optional user callback on a new subscriber
+	int retryMs; // reconnect delay sent to new subscribers, 0 to leave it to the client
+	Sse *subscribers; // Managed by the library
+};
+
+#define SSE_ROUTE_INIT(connectedCb, retryMs) { (connectedCb), (retryMs), NULL }
+
+CgiStatus ICACHE_FLASH_ATTR cgiSse(HttpdConnData *connData);
+
+/**
+ * Send an event to one subscriber.
+ *
+ * The data is split into a data: line per line of it. id and event may be NULL and must not
+ * contain line breaks.
+ * @return 1 on success, 0 if the connection couldn't take it
+ */
+int ICACHE_FLASH_ATTR httpdSseSend(HttpdInstance *pInstance, Sse *sse, const char *id, const char *event, const char *data);
+
+/**
+ * Send an event to all subscribers of a route. The event is formatted once and the same
+ * bytes go to every subscriber.
+ * @return the number of subscribers sent to
+ */
+int ICACHE_FLASH_ATTR httpdSseBroadcast(HttpdInstance *pInstance, SseRoute *route, const char *id, const char *event, const char *data);
+
+/**
+ * Disconnect a subscriber. Its closeCb is called once the connection is gone, from the httpd task.
+ */
+void ICACHE_FLASH_ATTR httpdSseClose(HttpdInstance *pInstance, Sse *sse);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
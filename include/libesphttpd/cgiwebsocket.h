@@ -22,6 +22,19 @@ typedef void(*WsRecvCb)(Websock *ws, char *data, int len, int flags);
 typedef void(*WsSentCb)(Websock *ws);
 typedef void(*WsCloseCb)(Websock *ws);
 
+/**
+ * Options of a websocket route, see ROUTE_WS_EX().
+ */
+typedef struct {
+	/**
+	 * If not 0, recvCb is called with whole messages instead of the pieces of them as they
+	 * arrive, never with WEBSOCK_FLAG_MORE. A message over this many bytes closes the
+	 * connection with 1009 (message too big). Messages that arrive in one piece are passed
+	 * on without a copy; others are put together in a buffer of this size.
+	 */
+	int maxMessageLen;
+} WebsockOpts;
+
 struct Websock {
 	struct kref ref_cnt; // reference count to manage lifetime of this shared object
 	void *userData; // optional user data to attach to a Websock object, not used by the library
@@ -20,8 +20,16 @@ extern "C" {
 //      ROUTE_CGI_ARG("*", cgiEspVfsGet, ".") to use the current working directory
 CgiStatus cgiEspVfsGet(HttpdConnData *connData);
 
+// cgiEspVfsGet keeps what it found out about paths (whether they exist, size, modification time)
+// for CONFIG_ESPHTTPD_VFS_STAT_CACHE_TTL_MS. Call this after changing files outside of
+// cgiEspVfsUpload so the changes are seen right away. Pass the full filesystem path of the
+// file, its .br and .gz variants are forgotten with it; NULL forgets everything, which is needed
+// after creating or removing directories.
+void cgiEspVfsInvalidate(const char *path);
+
 
 //This is a POST and PUT handler for uploading files to the VFS filesystem.
+// The data goes to a temporary file first, which replaces the file once the upload is complete.
 // If http method is not PUT or POST, this cgi function returns NOT_FOUND, and then other cgi functions specified later in the routing table can try.
 // Specify base directory (with trailing slash) or single file as 1st cgiArg.
 //
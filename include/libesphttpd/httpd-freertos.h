@@ -36,6 +36,7 @@ struct RtosConnType{
 	int fd;
 	int needWriteDoneNotif;
 	int needsClose;
+	int offloaded; // a worker task has the connection, don't read from it
 	int port;
 	char ip[4];
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
@@ -62,6 +63,10 @@ typedef struct
 
 	bool isShutdown;
 
+	// loopback udp socket, connected to itself, that other tasks wake the server task with
+	int wakeFd;
+	volatile bool wakePending;
+
 	// storage for data read in the main loop
 	char precvbuf[RECV_BUF_SIZE];
 
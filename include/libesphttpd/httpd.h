@@ -42,11 +42,25 @@ extern "C" {
 #define HTTPD_SENDBUFF_MAX_FILL	(HTTPD_SENDBUFF_SIZE - 2)
 #endif
 
+//A cgi of a route with .coalesce set that returned HTTPD_CGI_MORE after adding data is called
+//again right away, before anything is sent, as long as at least this many bytes of the send
+//buffer are free. Its output then goes out as a single chunk in a single write. Only cgis that
+//size their output with httpdSendAvail()/httpdSendPartial() can be called like that; the others
+//count on an empty buffer on each call.
+#ifndef HTTPD_CGI_COALESCE_MIN_FREE
+#define HTTPD_CGI_COALESCE_MIN_FREE	2048
+#endif
+
 //Send buffer limit (for backward compatibility
 #ifndef HTTPD_MAX_SENDBUFF_LEN
 #define HTTPD_MAX_SENDBUFF_LEN HTTPD_SENDBUFF_MAX_FILL
 #endif
 
+//Most bytes of data given to httpdSendRef() handed to the socket at once
+#ifndef HTTPD_SENDREF_SEGMENT_LEN
+#define HTTPD_SENDREF_SEGMENT_LEN	(2*HTTPD_SENDBUFF_SIZE)
+#endif
+
 //If some data can't be sent because the underlaying socket doesn't accept the data (like the nonos
 //layer is prone to do), we put it in a backlog that is dynamically malloc'ed. This defines the max
 //size of the backlog.
@@ -54,6 +68,17 @@ extern "C" {
 #define HTTPD_MAX_BACKLOG_SIZE	(4*1024)
 #endif
 
+//Responses of routes with compression enabled that are complete and smaller than this when
+//they are first sent go out uncompressed, unless the route sets its own minimum.
+#ifndef HTTPD_DEFLATE_MIN_LEN
+#define HTTPD_DEFLATE_MIN_LEN	256
+#endif
+
+//Number of paths the static file handlers remember the precompressed variants of.
+#ifndef HTTPD_VARIANT_CACHE_SIZE
+#define HTTPD_VARIANT_CACHE_SIZE	32
+#endif
+
 //Max length of CORS token. This amount is allocated per connection.
 #define MAX_CORS_TOKEN_LEN 256
 
@@ -62,7 +87,8 @@ typedef enum
 	HTTPD_CGI_MORE,
 	HTTPD_CGI_DONE,
 	HTTPD_CGI_NOTFOUND,
-	HTTPD_CGI_AUTHENTICATED
+	HTTPD_CGI_AUTHENTICATED,
+	HTTPD_CGI_SUSPEND		// Like HTTPD_CGI_MORE, but not called again until httpdResume()
 } CgiStatus;
 
 typedef enum
@@ -82,16 +108,42 @@ typedef enum
 	HTTPD_TRANSFER_NONE
 } TransferModes;
 
+typedef enum
+{
+	HTTPD_RANGE_NONE,			// No usable Range header, send the whole entity
+	HTTPD_RANGE_OK,				// Send the requested bytes with a 206 response
+	HTTPD_RANGE_UNSATISFIABLE	// Range lies outside the entity, send a 416 response
+} HttpdRangeResult;
+
+//Content codings a static file can be stored in, each as a sibling of the plain file with its
+//suffix added. Listed in order of preference for when the client accepts several equally.
+typedef enum {
+	HTTPD_ENC_BR,				// name.br, brotli compressed
+	HTTPD_ENC_GZIP,				// name.gz, gzip compressed
+	HTTPD_ENC_IDENTITY,			// name itself
+	HTTPD_ENC_COUNT
+} HttpdEncoding;
+
+#define HTTPD_ENC_BIT(enc) (1<<(enc))
+
+//Slot of a cache of the variants that exist of a path, see httpdVariantCacheGet().
+typedef struct {
+	uint32_t hash;				// Hash of the path, 0 if the slot is unused
+	uint8_t variants;			// HTTPD_ENC_BIT()s of the variants, plus any bits of the handler's own
+} HttpdVariantCacheEntry;
+
 typedef struct HttpdPriv HttpdPriv;
 typedef struct HttpdConnData HttpdConnData;
 typedef struct HttpdPostData HttpdPostData;
 typedef struct HttpdInstance HttpdInstance;
+typedef struct HttpdRouteOpts HttpdRouteOpts;
 
 
 typedef CgiStatus (* cgiSendCallback)(HttpdConnData *connData);
 typedef CgiStatus (* cgiRecvHandler)(HttpdInstance *pInstance, HttpdConnData *connData, char *data, int len);
 
 #ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
+typedef struct HttpSendBacklogItem HttpSendBacklogItem;
 struct HttpSendBacklogItem {
 	int len;
 	HttpSendBacklogItem *next;
@@ -117,7 +169,33 @@ struct HttpdPriv {
 	HttpSendBacklogItem *sendBacklog;
 	int sendBacklogSize;
 #endif
+	const char *sendRef;		// Rest of the data given to httpdSendRef(), sent after sendBuff
+	int sendRefLen;
+	const char *sendRefTrailer;	// What ends the chunk of the referenced data, if it's chunked
+	void (*sendRefDone)(void *arg);	// Called when through with data given to httpdSendRefShared()
+	void *sendRefDoneArg;
+	const struct HttpdStreamOps *streamOps;	// Source of the body, see httpdServeStream()
+	void *streamCtx;
+	long streamLeft;		// Bytes of the stream still to send, -1 to read it to its end
 	int flags;
+	bool resumePending;		// httpdResume() was called while the cgi was running
+	long contentLen;		// Body length set by httpdSetContentLength()
+	const HttpdRouteOpts *routeOpts;	// Options of the route handling the request, if any
+#ifdef CONFIG_ESPHTTPD_DEFLATE_SUPPORT
+	struct HttpdDeflate *deflate;	// Compressor of the response body, while it's being compressed
+	const char *encHdr;		// Content-Encoding header line to use if the body gets compressed
+	int encHdrPos;			// Offset in sendBuff of the room left for it
+#endif
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+	struct HttpdCacheEntry *cacheFill;	// Copy of the response being made, for the response cache
+#endif
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+	bool offloaded;			// A worker is running the cgi, and owns the rest of the connection until it's back
+	int offloadRoute;		// Index+1 of the route a first, offloaded, cgi call is for; 0 for later calls
+	bool reroute;			// That cgi passed on the request, the server task goes on with the next route
+	char *recvStash;		// Data received while the cgi was offloaded, handled once it's back
+	int recvStashLen;
+#endif
 };
 
 //A struct describing the POST data sent inside the http connection.  This is used by the CGI functions
@@ -145,9 +223,23 @@ struct HttpdConnData {
 	cgiSendCallback cgi;	// CGI function pointer
 	cgiRecvHandler recvHdl;	// Handler for data received after headers, if any
 	HttpdPostData post;	// POST data structure
+	HttpdInstance *pInstance;	// Server the connection belongs to
 	bool isConnectionClosed;
 };
 
+//Options of a route, see ROUTE_CGI_OPTS(). A request is held to the options of the first
+//route matching its url that has any. Zero means no limit beyond the compile-time ones.
+struct HttpdRouteOpts {
+	int maxUrlLen;			// Longest url, including the GET arguments. Longer gets a 414.
+	int maxHeadLen;			// Largest request head, at most HTTPD_MAX_HEAD_LEN. Larger gets a 431.
+	long maxBodyLen;		// Largest Content-Length. Larger gets a 413 before any body is read.
+	bool compress;			// Compress text responses if the client accepts it. Needs CONFIG_ESPHTTPD_DEFLATE_SUPPORT.
+	int compressMinLen;		// Smallest response to compress, 0 for HTTPD_DEFLATE_MIN_LEN.
+	bool offload;			// Run the cgi of this route on a worker task. Needs CONFIG_ESPHTTPD_OFFLOAD_SUPPORT.
+	int cacheTtlMs;			// Answer GET requests from a copy of the response this long. Needs CONFIG_ESPHTTPD_RESPONSE_CACHE.
+	bool coalesce;			// Call the cgi again before sending while the send buffer has room, see HTTPD_CGI_COALESCE_MIN_FREE.
+};
+
 //A struct describing an url. This is the main struct that's used to send different URL requests to
 //different routines.
 typedef struct {
@@ -155,6 +247,7 @@ typedef struct {
 	cgiSendCallback cgiCb;
 	const void *cgiArg;
 	const void *cgiArg2;
+	const HttpdRouteOpts *opts;	// Optional request limits and other options for this route
 } HttpdBuiltInUrl;
 
 extern const char *httpdCgiEx;  /* Magic for use in CgiArgs to interpret CgiArgs2 as HttpdCgiExArg */
@@ -193,6 +286,13 @@ typedef struct HttpdInstance
 	const HttpdBuiltInUrl *builtInUrls;
 
 	int maxConnections;
+
+	struct WsTopic *wsTopics;	// Urls with websockets on them, see cgiwebsocket.c
+
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+	struct HttpdCacheEntry *respCache;	// Responses of routes with a cacheTtlMs
+	int respCacheCount;
+#endif
 } HttpdInstance;
 
 typedef enum
@@ -205,7 +305,26 @@ typedef enum
 } CallbackStatus;
 
 const char *httpdGetMimetype(const char *url);
+
+/**
+ * Register a mime type for a file extension, or override a built-in one
+ *
+ * Call at init time, before the server is started. Only the pointers are stored,
+ * so both strings must remain valid while the server runs.
+ *
+ * @param ext extension without the dot, e.g. "glb" (matched case-insensitively)
+ * @return false if the mime table is full
+ */
+bool httpdRegisterMimetype(const char *ext, const char *mimetype);
 void httpdSetTransferMode(HttpdConnData *conn, TransferModes mode);
+
+/**
+ * Send the body with a Content-Length header instead of chunked encoding
+ *
+ * Keep-alive connections stay alive, the body just goes out unframed. Call before
+ * httpdStartResponse(); the cgi must then send exactly len bytes of body.
+ */
+void httpdSetContentLength(HttpdConnData *conn, long len);
 void httpdStartResponse(HttpdConnData *conn, int code);
 void httpdHeader(HttpdConnData *conn, const char *field, const char *val);
 void httpdEndHeaders(HttpdConnData *conn);
@@ -220,16 +339,175 @@ void httpdEndHeaders(HttpdConnData *conn);
  */
 bool httpdGetHeader(HttpdConnData *conn, const char *header, char *ret, int retLen);
 
+/**
+ * Look up how much the client wants a content coding ("gzip", "br", "identity"...), going
+ * by the Accept-Encoding header of the request.
+ *
+ * @return the q-value in thousandths: 1000 for most preferred, 0 if not acceptable
+ */
+int httpdGetEncodingQ(HttpdConnData *conn, const char *coding);
+
+/**
+ * Pick the variant of a static file to send, going by the q-values of the Accept-Encoding header
+ * of the request.
+ *
+ * @param available HTTPD_ENC_BIT()s of the variants that exist
+ * @return the variant, or HTTPD_ENC_COUNT if the client accepts none of them
+ */
+HttpdEncoding httpdNegotiateEncoding(HttpdConnData *conn, unsigned int available);
+
+/** @return the file name suffix of a variant: ".br", ".gz" or "" */
+const char *httpdEncodingSuffix(HttpdEncoding enc);
+
+/** @return the content coding of a variant, for Content-Encoding: "br", "gzip" or "identity" */
+const char *httpdEncodingName(HttpdEncoding enc);
+
+/**
+ * Look up the variants of a path in a cache of size entries, which the caller allocates zeroed
+ * and clears again when files change. Each path maps to a single slot, a path stored later
+ * evicts whatever was there.
+ *
+ * @return true if the path is cached, with its variants put in *variants
+ */
+bool httpdVariantCacheGet(HttpdVariantCacheEntry *cache, int size, const char *path, uint8_t *variants);
+
+/** Store the variants of a path in the cache. Storing 0 remembers the path doesn't exist. */
+void httpdVariantCachePut(HttpdVariantCacheEntry *cache, int size, const char *path, uint8_t variants);
+
+/** The hash paths are kept under in caches like the one above. Never 0. */
+uint32_t httpdPathHash(const char *path);
+
+/**
+ * Check an entity tag (including its quotes) against the If-None-Match header of the request.
+ *
+ * @return true if the client's cached copy is current and a 304 response can be sent
+ */
+bool httpdEtagMatches(HttpdConnData *conn, const char *etag);
+
+/**
+ * Parse the Range header of a GET request for an entity of the given size
+ *
+ * Only single byte ranges are supported, anything else yields HTTPD_RANGE_NONE.
+ *
+ * @param etag entity tag of the resource for If-Range, or NULL
+ * @param start, end receive the first and last (inclusive) byte on HTTPD_RANGE_OK
+ */
+HttpdRangeResult httpdGetRange(HttpdConnData *conn, long size, const char *etag, long *start, long *end);
+
 int httpdSend(HttpdConnData *conn, const char *data, int len);
+
+/**
+ * @return number of bytes httpdSend() or httpdSendPartial() will accept right now
+ */
+int httpdSendAvail(HttpdConnData *conn);
+
+/**
+ * @return true if the send buffer is empty and httpdFlushSendBuffer() empties it again, so data
+ * of any length can be added with httpdSendPartial() and flushed in turns without stalling
+ */
+bool httpdSendBuffEmpty(HttpdConnData *conn);
+
+/**
+ * Add as much of the data to the send buffer as fits
+ *
+ * Unlike httpdSend(), which takes all of the data or none of it, this lets a cgi fill
+ * the send buffer completely and resume where it stopped on its next call.
+ *
+ * @param len length of data, or -1 for a C-string
+ * @return number of bytes taken
+ */
+int httpdSendPartial(HttpdConnData *conn, const char *data, int len);
+
+/**
+ * Send data by reference instead of copying it into the send buffer
+ *
+ * The data goes out after what's in the send buffer, straight from where it is, in writes of
+ * up to HTTPD_SENDREF_SEGMENT_LEN bytes. Files in memory mapped flash are the typical use. The
+ * data must stay valid until it's all sent; the cgi should return HTTPD_CGI_MORE, and is only
+ * called again after that. Nothing else can be sent in the meantime.
+ *
+ * If the data can't be taken by reference, because there's some pending already or the
+ * response is being compressed, as much as fits is copied like httpdSendPartial() does.
+ *
+ * @param len length of data, or -1 for a C-string
+ * @return number of bytes taken
+ */
+int httpdSendRef(HttpdConnData *conn, const char *data, int len);
+
+/**
+ * Send data shared by several connections by reference
+ *
+ * Like httpdSendRef(), but done(arg) is called once the connection is through with the data,
+ * all sent or the connection gone, so the data can be freed when the last one is. Nothing is
+ * copied: if the data can't be taken by reference, none of it is taken and done isn't called.
+ * With CONFIG_ESPHTTPD_BACKLOG_SUPPORT, data still pending by reference from before is moved to
+ * the backlog to make room.
+ *
+ * @return true if the data was taken
+ */
+bool httpdSendRefShared(HttpdConnData *conn, const char *data, int len, void (*done)(void *arg), void *arg);
+
+/**
+ * A source of a response body for httpdServeStream()
+ */
+typedef struct HttpdStreamOps {
+	/**
+	 * Read the next bytes of the body
+	 * @return number of bytes read, 0 at the end of the body, -1 on error
+	 */
+	int (*read)(void *ctx, char *buf, int len);
+	/**
+	 * Optional, called once when the body is sent or the connection is gone. Frees ctx.
+	 */
+	void (*close)(void *ctx);
+} HttpdStreamOps;
+
+/**
+ * Hand the rest of the response body over to the server
+ *
+ * Call after httpdEndHeaders() and return what this returns. From then on the server reads the
+ * body from the source straight into the send buffer whenever the connection can take more,
+ * and finishes the response when it's done; the cgi isn't called again, so anything it still
+ * holds should be part of ctx. Compression applies as it does to what the cgi sends.
+ *
+ * For a byte range, position the source at the start of the range and pass its length. If
+ * the source ends or fails before len bytes, the connection is closed after what was sent so
+ * the client can tell the body is incomplete.
+ *
+ * @param len number of bytes to send, or -1 to send until read() returns 0
+ * @return HTTPD_CGI_MORE
+ */
+CgiStatus httpdServeStream(HttpdConnData *conn, const HttpdStreamOps *ops, void *ctx, long len);
 int httpdSend_js(HttpdConnData *conn, const char *data, int len);
 int httpdSend_html(HttpdConnData *conn, const char *data, int len);
 void httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn);
 CallbackStatus httpdContinue(HttpdInstance *pInstance, HttpdConnData *conn);
+
+/**
+ * Wake up a connection whose cgi returned HTTPD_CGI_SUSPEND; the server task calls the cgi
+ * again. Safe to call from any task. A resume that comes in while the cgi runs isn't lost: if
+ * the cgi then returns HTTPD_CGI_SUSPEND it's called again straight away.
+ *
+ * NOTE: conn must not be resumed anymore once the cgi has been called with isConnectionClosed
+ */
+void httpdResume(HttpdInstance *pInstance, HttpdConnData *conn);
+
+#ifdef CONFIG_ESPHTTPD_RESPONSE_CACHE
+/**
+ * Drop cached responses, for instance because the data they show changed.
+ *
+ * @param route the route pattern, as in the route list, to drop the responses of, or NULL for all
+ */
+void httpdCacheInvalidate(HttpdInstance *pInstance, const char *route);
+#endif
 CallbackStatus httpdConnSendStart(HttpdInstance *pInstance, HttpdConnData *conn);
 void httpdConnSendFinish(HttpdInstance *pInstance, HttpdConnData *conn);
 void httpdAddCacheHeaders(HttpdConnData *connData, const char *mime);
 
 //Platform dependent code should call these.
+#ifdef CONFIG_ESPHTTPD_OFFLOAD_SUPPORT
+void httpdOffloadRun(HttpdInstance *pInstance, HttpdConnData *pConn);
+#endif
 CallbackStatus httpdSentCb(HttpdInstance *pInstance, HttpdConnData *pConn);
 CallbackStatus httpdRecvCb(HttpdInstance *pInstance, HttpdConnData *pConn, char *data, unsigned short len);
 CallbackStatus httpdDisconCb(HttpdInstance *pInstance, HttpdConnData *pConn);
@@ -7,6 +7,9 @@
 /** Route with a CGI handler and two arguments */
 #define ROUTE_CGI_ARG2(path, handler, arg1, arg2)  {(path), (handler), (void *)(arg1), (void *)(arg2)}
 
+/** Route with a CGI handler, two arguments and options (const HttpdRouteOpts *) */
+#define ROUTE_CGI_OPTS(path, handler, arg1, arg2, opts) {(path), (handler), (void *)(arg1), (void *)(arg2), (opts)}
+
 /** Route with a CGI handler and one argument */
 #define ROUTE_CGI_ARG(path, handler, arg1)         ROUTE_CGI_ARG2((path), (handler), (arg1), NULL)
 
@@ -37,7 +40,13 @@
 /** Websocket endpoint */
 #define ROUTE_WS(path, callback)                   ROUTE_CGI_ARG((path), cgiWebsocket, (WsConnectedCb)(callback))
 
+/** Websocket endpoint with options (const WebsockOpts *) */
+#define ROUTE_WS_EX(path, callback, opts)          ROUTE_CGI_ARG2((path), cgiWebsocket, (WsConnectedCb)(callback), (const WebsockOpts*)(opts))
+
+/** Server-Sent Events endpoint, sseRoute is a pointer to a SseRoute */
+#define ROUTE_SSE(path, sseRoute)                  ROUTE_CGI_ARG((path), cgiSse, (SseRoute*)(sseRoute))
+
 /** Catch-all filesystem route */
 #define ROUTE_FILESYSTEM()                         ROUTE_CGI("*", cgiEspFsHook)
 
-#define ROUTE_END() {NULL, NULL, NULL, NULL}
+#define ROUTE_END() {NULL, NULL, NULL, NULL, NULL}
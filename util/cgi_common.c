@@ -219,20 +219,11 @@ CgiStatus cgiResponseCommonMulti(HttpdConnData *connData, void **statepp, char *
 
 	if (statep->len_to_send > 0)
 	{
-		size_t max_send_size = SENDBUFSIZE;
-		size_t len_to_send_this_time = (statep->len_to_send < max_send_size) ? (statep->len_to_send) : (max_send_size);
-		ESP_LOGD(__func__, "tosendthistime: %d", len_to_send_this_time);
-		int success = httpdSend(connData, statep->toSendPosition, len_to_send_this_time);
-		if (success)
-		{
-			statep->len_to_send -= len_to_send_this_time;
-			statep->toSendPosition += len_to_send_this_time;
-		}
-		else
-		{
-			ESP_LOGE(__func__, "httpdSend out-of-memory");
-			statep->len_to_send = 0;
-		}
+		// Fill the send buffer as far as it goes, the rest is sent on the next call.
+		int len_sent_this_time = httpdSendPartial(connData, statep->toSendPosition, statep->len_to_send);
+		ESP_LOGD(__func__, "sentthistime: %d", len_sent_this_time);
+		statep->len_to_send -= len_sent_this_time;
+		statep->toSendPosition += len_sent_this_time;
 	}
 
 	if (statep->len_to_send <= 0 || // finished sending
@@ -0,0 +1,207 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Server-Sent Events (text/event-stream) support. A subscriber is a response that never ends; events
+are written into it as chunks. Each route keeps its own list of subscribers, so a broadcast only
+walks the clients of that route, and formats the event just once for all of them.
+*/
+
+#ifdef linux
+#include <libesphttpd/linux.h>
+#else
+#include <libesphttpd/esp.h>
+#endif
+
+#include "libesphttpd/httpd.h"
+#include "httpd-platform.h"
+#include "libesphttpd/cgisse.h"
+
+#include "esp_log.h"
+const static char* TAG = "cgisse";
+
+//Longest Last-Event-ID header kept.
+#define SSE_LAST_ID_LEN 64
+
+//Writes the wire form of an event to buf, if it isn't NULL, and returns its length: the id and
+//event lines, a data line for every line of data, and the empty line that ends the event.
+static int ICACHE_FLASH_ATTR sseFormat(char *buf, const char *id, const char *event, const char *data) {
+	int len=0;
+	int n;
+
+#define SSE_PUT(s, l) do { if (buf) memcpy(buf+len, (s), (l)); len+=(l); } while (0)
+	if (id) {
+		SSE_PUT("id: ", 4);
+		SSE_PUT(id, strlen(id));
+		SSE_PUT("\n", 1);
+	}
+	if (event) {
+		SSE_PUT("event: ", 7);
+		SSE_PUT(event, strlen(event));
+		SSE_PUT("\n", 1);
+	}
+	if (data) {
+		while (1) {
+			n=strcspn(data, "\r\n");
+			SSE_PUT("data: ", 6);
+			SSE_PUT(data, n);
+			SSE_PUT("\n", 1);
+			data+=n;
+			if (*data==0) break;
+			//A CR LF pair is one line break, as the client sees it.
+			if (data[0]=='\r' && data[1]=='\n') data++;
+			data++;
+		}
+	}
+	SSE_PUT("\n", 1);
+#undef SSE_PUT
+	return len;
+}
+
+//Sends len bytes to a subscriber, flushing whenever the send buffer fills up so an event
+//larger than the buffer still goes out whole. An event is only started if it fits in the room
+//left, or if every flush empties the buffer; otherwise it's skipped before anything is copied,
+//so a backed up connection never gets part of one. The server must be locked.
+static int ICACHE_FLASH_ATTR sseSendRaw(HttpdInstance *pInstance, Sse *sse, const char *data, int len) {
+	int n;
+	if (httpdSendAvail(sse->conn)<len) {
+		httpdFlushSendBuffer(pInstance, sse->conn);
+		if (httpdSendAvail(sse->conn)<len && !httpdSendBuffEmpty(sse->conn)) return 0;
+	}
+	while (len>0) {
+		n=httpdSendPartial(sse->conn, data, len);
+		if (n==0) {
+			httpdFlushSendBuffer(pInstance, sse->conn);
+			//Can't happen after the check above, but don't spin if it does.
+			if (httpdSendAvail(sse->conn)==0) return 0;
+			continue;
+		}
+		data+=n;
+		len-=n;
+	}
+	httpdFlushSendBuffer(pInstance, sse->conn);
+	return 1;
+}
+
+int ICACHE_FLASH_ATTR httpdSseSend(HttpdInstance *pInstance, Sse *sse, const char *id, const char *event, const char *data) {
+	int r=0;
+	int len=sseFormat(NULL, id, event, data);
+	char *buf=malloc(len);
+	if (buf==NULL) {
+		ESP_LOGE(TAG, "Can't allocate %d bytes for event", len);
+		return 0;
+	}
+	sseFormat(buf, id, event, data);
+	httpdPlatLock(pInstance);
+	if (sse->conn!=NULL) r=sseSendRaw(pInstance, sse, buf, len);
+	httpdPlatUnlock(pInstance);
+	free(buf);
+	return r;
+}
+
+int ICACHE_FLASH_ATTR httpdSseBroadcast(HttpdInstance *pInstance, SseRoute *route, const char *id, const char *event, const char *data) {
+	int ret=0;
+	Sse *sse;
+	int len=sseFormat(NULL, id, event, data);
+	char *buf=malloc(len);
+	if (buf==NULL) {
+		ESP_LOGE(TAG, "Can't allocate %d bytes for event", len);
+		return 0;
+	}
+	sseFormat(buf, id, event, data);
+	httpdPlatLock(pInstance);
+	for (sse=route->subscribers; sse!=NULL; sse=sse->next) {
+		if (sse->conn!=NULL && sseSendRaw(pInstance, sse, buf, len)) ret++;
+	}
+	httpdPlatUnlock(pInstance);
+	free(buf);
+	return ret;
+}
+
+void ICACHE_FLASH_ATTR httpdSseClose(HttpdInstance *pInstance, Sse *sse) {
+	httpdPlatLock(pInstance);
+	if (sse->conn!=NULL) {
+		httpdFlushSendBuffer(pInstance, sse->conn);
+		httpdPlatDisconnect(sse->conn);
+		sse->conn=NULL; // mark as closed; the Sse itself goes when the connection does
+	}
+	httpdPlatUnlock(pInstance);
+}
+
+static void ICACHE_FLASH_ATTR sseUnlink(Sse *sse) {
+	Sse **pp;
+	for (pp=&sse->route->subscribers; *pp!=NULL; pp=&(*pp)->next) {
+		if (*pp==sse) {
+			*pp=sse->next;
+			break;
+		}
+	}
+}
+
+CgiStatus ICACHE_FLASH_ATTR cgiSse(HttpdConnData *connData) {
+	char lastId[SSE_LAST_ID_LEN];
+	char buff[24];
+	SseRoute *route=(SseRoute*)connData->cgiArg;
+	Sse *sse=(Sse*)connData->cgiData;
+
+	if (connData->isConnectionClosed) {
+		//Connection gone. Clean up.
+		if (sse) {
+			ESP_LOGD(TAG, "Subscriber %p gone", sse);
+			sseUnlink(sse);
+			sse->conn=NULL;
+			if (sse->closeCb) sse->closeCb(sse);
+			free(sse);
+			connData->cgiData=NULL;
+		}
+		return HTTPD_CGI_DONE;
+	}
+
+	if (sse!=NULL) {
+		//Sent callback; events are pushed from outside the cgi, nothing to do.
+		return HTTPD_CGI_MORE;
+	}
+
+	if (connData->requestType!=HTTPD_METHOD_GET) {
+		httpdStartResponse(connData, 405);
+		httpdHeader(connData, "Allow", "GET");
+		httpdEndHeaders(connData);
+		return HTTPD_CGI_DONE;
+	}
+
+	sse=calloc(1, sizeof(Sse));
+	if (sse==NULL) {
+		ESP_LOGE(TAG, "Can't allocate mem for subscriber");
+		httpdStartResponse(connData, 503);
+		httpdEndHeaders(connData);
+		return HTTPD_CGI_DONE;
+	}
+	sse->conn=connData;
+	sse->route=route;
+
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/event-stream");
+	httpdHeader(connData, "Cache-Control", "no-cache");
+	httpdEndHeaders(connData);
+	if (route->retryMs>0) {
+		sprintf(buff, "retry: %d\n\n", route->retryMs);
+		httpdSend(connData, buff, -1);
+	}
+
+	connData->cgiData=sse;
+	//Broadcasts walk the list with the server locked.
+	httpdPlatLock(connData->pInstance);
+	sse->next=route->subscribers;
+	route->subscribers=sse;
+	httpdPlatUnlock(connData->pInstance);
+
+	if (route->connectedCb) {
+		if (httpdGetHeader(connData, "Last-Event-ID", lastId, sizeof(lastId))) {
+			route->connectedCb(sse, lastId);
+		} else {
+			route->connectedCb(sse, NULL);
+		}
+	}
+	return HTTPD_CGI_MORE;
+}
@@ -11,7 +11,6 @@ Websocket support for esphttpd. Inspired by https://github.com/dangrie158/ESP-82
 #else
 #include <libesphttpd/esp.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
 #endif
 
 #include "libesphttpd/httpd.h"
@@ -20,6 +19,10 @@ Websocket support for esphttpd. Inspired by https://github.com/dangrie158/ESP-82
 #include "libesphttpd_base64.h"
 #include "libesphttpd/cgiwebsocket.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //#define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
 #include "esp_log.h"
 const static char* TAG = "cgiwebsocket";
@@ -81,47 +84,98 @@ struct WebsockFrame {
 	uint8_t mask[4];
 };
 
+typedef struct WsMsgBuf WsMsgBuf;
+typedef struct WsTopic WsTopic;
+
+//The websockets open on one url, the ones cgiWebsockBroadcast() sends to. The array grows and
+//shrinks with them; each websocket knows its index in it, so it's taken out without a search.
+struct WsTopic {
+	WsTopic *next;
+	Websock **subs;
+	int count;
+	int size;
+	char url[];
+};
+
+//Smallest subscriber array a url gets.
+#define WS_TOPIC_MIN_SIZE (4)
+
+//A frame as it goes out, shared by all the websockets a broadcast sends it to.
+typedef struct {
+	struct kref ref_cnt;
+	int len;
+	char data[];
+} WsFrameBuf;
+
+//Buffer a message is put together in, for routes with a maxMessageLen.
+struct WsMsgBuf {
+	WsMsgBuf *next;
+	int size;
+	char data[];
+};
+
 struct WebsockPriv {
 	struct WebsockFrame fr;
 	uint8_t maskCtr;
 	uint8 frameCont;
 	int wsStatus;
+	int maxMessageLen; // From the WebsockOpts of the route, 0 to pass on fragments as they come
+	int msgFlags; // WEBSOCK_FLAG_BIN if the message being put together is binary
+	int msgLen; // Bytes of the message in msg so far
+	WsMsgBuf *msg;
+	HttpdInstance *pInstance; // Server the websocket's url is registered with
+	WsTopic *topic; // Subscribers of the url this websocket is on
+	int subIndex; // Index in topic->subs
 };
 
+//Message buffers kept for reuse once their message is delivered, so a busy connection doesn't
+//allocate one per message. Shared by all server instances, so only touched with
+//httpdPlatSharedLock() held.
+#define WEBSOCK_MSG_POOL_SIZE (2)
+static WsMsgBuf *msgPool = NULL;
+static int msgPoolCount = 0;
 
-#define WEBSOCK_LIST_SIZE (32)
-// List of active Websockets (TODO: not support multiple httpd instances yet)
-static Websock *wsList[WEBSOCK_LIST_SIZE] = {NULL};
-// Recursive mutex to protect list
-static SemaphoreHandle_t wsListMutex=NULL;
 
-// Lock access to list
-static bool ICACHE_FLASH_ATTR wsListLock(void)
-{
-	if (wsListMutex == NULL) {
-		wsListMutex = xSemaphoreCreateRecursiveMutex();
-	}
-	assert(wsListMutex != NULL);
-	ESP_LOGD(TAG, "Lock list. Task: %p", xTaskGetCurrentTaskHandle());
-	// Take the mutex recursively
-	if (pdTRUE != xSemaphoreTakeRecursive(wsListMutex, portMAX_DELAY)) {
-		ESP_LOGE(TAG, "Failed to take mutex");
-		return false;
+static bool check_websock_closed(Websock *ws) {
+    return ((NULL == ws->conn) || (ws->conn->isConnectionClosed));
+}
+
+//Takes a buffer of at least size bytes from the pool, or allocates one.
+static WsMsgBuf ICACHE_FLASH_ATTR *wsMsgBufGet(int size) {
+	WsMsgBuf **pp, *b;
+	httpdPlatSharedLock();
+	for (pp=&msgPool; *pp!=NULL; pp=&(*pp)->next) {
+		if ((*pp)->size>=size) {
+			b=*pp;
+			*pp=b->next;
+			msgPoolCount--;
+			httpdPlatSharedUnlock();
+			return b;
+		}
 	}
-	return true;
+	httpdPlatSharedUnlock();
+	b=malloc(sizeof(WsMsgBuf)+size);
+	if (b!=NULL) b->size=size;
+	return b;
 }
 
-// Unlock list access
-static void ICACHE_FLASH_ATTR wsListUnlock(void)
-{
-	assert(wsListMutex != NULL);
-	ESP_LOGD(TAG, "Unlock list. Task: %p", xTaskGetCurrentTaskHandle());
-	// Give the mutex recursively
-	xSemaphoreGiveRecursive(wsListMutex);
+static void ICACHE_FLASH_ATTR wsMsgBufPut(WsMsgBuf *b) {
+	httpdPlatSharedLock();
+	if (msgPoolCount<WEBSOCK_MSG_POOL_SIZE) {
+		b->next=msgPool;
+		msgPool=b;
+		msgPoolCount++;
+		b=NULL;
+	}
+	httpdPlatSharedUnlock();
+	free(b);
 }
 
-static bool check_websock_closed(Websock *ws) {
-    return ((NULL == ws->conn) || (ws->conn->isConnectionClosed));
+//Gives back the buffer of a message, if it has one.
+static void ICACHE_FLASH_ATTR wsMsgRelease(WebsockPriv *priv) {
+	if (priv->msg!=NULL) wsMsgBufPut(priv->msg);
+	priv->msg=NULL;
+	priv->msgLen=0;
 }
 
 /* Free data, must only be called by kref_put()! */
@@ -131,7 +185,11 @@ static void ICACHE_FLASH_ATTR free_websock(struct kref *ref)
 	Websock *ws;
 
 	ws = kcontainer_of(ref, Websock, ref_cnt);
-	if (ws->priv) free(ws->priv);
+	if (ws->priv) {
+		// Normally given back to the pool when the connection closed
+		free(ws->priv->msg);
+		free(ws->priv);
+	}
 	// Note we don't free ws->conn, since it is managed by the httpd instance.
 	free(ws);
 }
@@ -143,75 +201,79 @@ static void put_websock(Websock *ws)
 	kref_put(&(ws->ref_cnt), free_websock);
 }
 
-/* Get a reference counted pointer to a Websock object by index. *\
-\* Must be released via put_websock()!                           */
-static struct Websock *get_websock(unsigned int index)
+// Find the subscribers of a url. The server must be locked.
+static WsTopic ICACHE_FLASH_ATTR *wsFindTopic(HttpdInstance *pInstance, const char *url)
 {
-	Websock *retWs = NULL;
-	if ((index < WEBSOCK_LIST_SIZE) && 
-		(NULL != wsList[index])) // do an early NULL check to avoid locking an empty slot
-	{
-		if (wsListLock())
-		{
-			if (wsList[index] != NULL) // double check for NULL now that we have the lock
-			{
-				// check if the websocket is closed and remove it from the list
-				// (Optional to do it here, since it is also done in wsListAddAndGC) 
-				if (check_websock_closed(wsList[index])) {
-					ESP_LOGD(TAG, "Cleaning up websocket %p", wsList[index]);
-					put_websock(wsList[index]); // decrement reference count for the ref in the list
-					wsList[index] = NULL; // remove from list
-					// will return NULL to indicate closed
-				} else { 	
-					// ws is still open
-					retWs = wsList[index];
-					// increment reference count, since we will be retuning a pointer to it
-					kref_get(&(retWs->ref_cnt));
-				}
-			}
-			wsListUnlock();
-		}
+	WsTopic *t;
+	for (t = pInstance->wsTopics; t != NULL; t = t->next) {
+		if (strcmp(t->url, url) == 0) return t;
 	}
-	return retWs;
+	return NULL;
 }
 
-// Add websocket to list, and garbage collect dead websockets
-static void ICACHE_FLASH_ATTR wsListAddAndGC(Websock *ws)
+// Resize the subscriber array of a url. Returns false if out of memory, leaving it as it was.
+static bool ICACHE_FLASH_ATTR wsTopicResize(WsTopic *t, int size)
 {
-	ESP_LOGD(TAG, "Adding to list. Task: %p", xTaskGetCurrentTaskHandle());
-	if (wsListLock()) // protect access to list, since it could be used/modified outside this thread
-	{
-		// Garbage collection
-		for (int i = 0; i < WEBSOCK_LIST_SIZE; i++) {
-			if (wsList[i] != NULL) {
-				if (check_websock_closed(wsList[i])) {
-					ESP_LOGD(TAG, "Cleaning up websocket %p", wsList[i]);
-					put_websock(wsList[i]); // decrement reference count
-					wsList[i] = NULL;
-				}
-			}
-		}
-		// Insert ws into list
-		int j = 0;
-		// Find first empty slot
-		for (; j < WEBSOCK_LIST_SIZE; j++) {
-			// Check if slot is empty
-			if (wsList[j] == NULL) {
-				ESP_LOGD(TAG, "Adding websocket %p to slot %d", ws, j);
-				kref_get(&(ws->ref_cnt)); // increment reference count
-				wsList[j] = ws;
-				break;
-			}
+	Websock **subs = realloc(t->subs, size * sizeof(Websock*));
+	if (subs == NULL) return false;
+	t->subs = subs;
+	t->size = size;
+	return true;
+}
+
+// Add websocket to the subscribers of its url. The subscriber sets of an instance are only
+// changed with the server locked.
+static void ICACHE_FLASH_ATTR wsSubscribe(HttpdInstance *pInstance, Websock *ws)
+{
+	WsTopic *t = wsFindTopic(pInstance, ws->conn->url);
+	if (t == NULL) {
+		t = calloc(1, sizeof(WsTopic) + strlen(ws->conn->url) + 1);
+		if (t == NULL) {
+			ESP_LOGE(TAG, "Can't allocate mem for url");
+			return;
 		}
-		if (j == WEBSOCK_LIST_SIZE) {
-			ESP_LOGE(TAG, "Websocket list full");
+		strcpy(t->url, ws->conn->url);
+		t->next = pInstance->wsTopics;
+		pInstance->wsTopics = t;
+	}
+	if (t->count == t->size && !wsTopicResize(t, t->size ? t->size * 2 : WS_TOPIC_MIN_SIZE)) {
+		ESP_LOGE(TAG, "Can't allocate mem for %d subscribers", t->size * 2);
+		if (t->count == 0) {
+			pInstance->wsTopics = t->next; // just added it
+			free(t);
 		}
-		wsListUnlock();
+		return;
 	}
+	ws->priv->pInstance = pInstance;
+	ws->priv->topic = t;
+	ws->priv->subIndex = t->count;
+	t->subs[t->count++] = ws;
 }
 
-static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
-	char buf[14];
+// Remove websocket from the subscribers of its url, if it's still one. The last subscriber
+// takes its place in the array; the url goes away with its last subscriber.
+static void ICACHE_FLASH_ATTR wsUnsubscribe(Websock *ws)
+{
+	WsTopic *t = ws->priv->topic, **pp;
+	Websock *last;
+	if (t == NULL) return;
+	last = t->subs[--t->count];
+	t->subs[ws->priv->subIndex] = last;
+	last->priv->subIndex = ws->priv->subIndex;
+	ws->priv->topic = NULL;
+
+	if (t->count == 0) {
+		for (pp = &ws->priv->pInstance->wsTopics; *pp != t; pp = &(*pp)->next);
+		*pp = t->next;
+		free(t->subs);
+		free(t);
+	} else if (t->size > WS_TOPIC_MIN_SIZE && t->count <= t->size / 4) {
+		wsTopicResize(t, t->size / 2); // keeps the larger array if this fails
+	}
+}
+
+//Writes a frame header to buf, which needs room for 10 bytes. Returns its length.
+static int ICACHE_FLASH_ATTR wsFrameHead(char *buf, int opcode, int len) {
 	int i=0;
 	buf[i++]=opcode;
 	if (len>65535) {
@@ -228,14 +290,19 @@ static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
 	} else {
 		buf[i++]=len;
 	}
+	return i;
+}
+
+static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
+	char buf[14];
+	int i=wsFrameHead(buf, opcode, len);
 	ESP_LOGD(TAG, "Sent frame head for payload of %d bytes", len);
 	return httpdSend(ws->conn, buf, i);
 }
 
-int ICACHE_FLASH_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags) {
-	int r=0;
+//The first byte of the header of a frame sent with the given WEBSOCK_FLAG_*s.
+static int ICACHE_FLASH_ATTR wsFrameOpcode(int flags) {
 	int fl=0;
-
 	// Continuation frame has opcode 0
 	if (!(flags&WEBSOCK_FLAG_CONT)) {
 		if (flags & WEBSOCK_FLAG_BIN)
@@ -245,6 +312,12 @@ int ICACHE_FLASH_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, co
 	}
 	// add FIN to last frame
 	if (!(flags&WEBSOCK_FLAG_MORE)) fl|=FLAG_FIN;
+	return fl;
+}
+
+int ICACHE_FLASH_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags) {
+	int r=0;
+	int fl=wsFrameOpcode(flags);
 
 	httpdPlatLock(pInstance);
 	if (check_websock_closed(ws)) {
@@ -259,30 +332,66 @@ int ICACHE_FLASH_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, co
 	return r;
 }
 
+static void ICACHE_FLASH_ATTR free_frame(struct kref *ref)
+{
+	free(kcontainer_of(ref, WsFrameBuf, ref_cnt));
+}
+
+//Called by the server when a websocket is through with a broadcast frame.
+static void ICACHE_FLASH_ATTR wsFrameSent(void *arg)
+{
+	kref_put(&((WsFrameBuf*)arg)->ref_cnt, free_frame);
+}
+
 //Broadcast data to all websockets at a specific url. Returns the amount of connections sent to.
+//The frame is put together once, and queued on each connection by reference, with the server
+//locked once for all of them. The subscribers are sent to from a copy of the set, each with a
+//reference held, so one that closes or subscribes during the sends doesn't disturb the loop.
 int ICACHE_FLASH_ATTR cgiWebsockBroadcast(HttpdInstance *pInstance, const char *resource, const char *data, int len, int flags) {
-	int ret = 0;
-
-	for (int i = 0; i < WEBSOCK_LIST_SIZE; i++) {
-		Websock *ws = get_websock(i); // get a reference counted pointer to the Websock object from the list
-		if (NULL != ws) {
-			httpdPlatLock(pInstance); // lock needed so we can access the connData to check for routeMatch
-			if (check_websock_closed(ws)) {
-				ESP_LOGD(TAG, "Websocket %p closed", ws);
-				httpdPlatUnlock(pInstance);
-				continue;
-			}
-			// else ws is still open
-			bool routeMatch = (strcmp(ws->conn->url, resource) == 0);
-			httpdPlatUnlock(pInstance);
+	int ret = 0, i, n = 0;
+	WsTopic *t;
+	Websock *ws, **subs = NULL;
+	WsFrameBuf *fb = malloc(sizeof(WsFrameBuf) + 10 + len);
+	if (fb == NULL) {
+		ESP_LOGE(TAG, "Can't allocate %d bytes for frame", len);
+		return 0;
+	}
+	kref_init(&(fb->ref_cnt)); // the reference of this function
+	fb->len = wsFrameHead(fb->data, wsFrameOpcode(flags), len);
+	memcpy(fb->data + fb->len, data, len);
+	fb->len += len;
 
-			if (routeMatch) {
-				cgiWebsocketSend(pInstance, ws, data, len, flags);
-				ret++;
+	httpdPlatLock(pInstance);
+	t = wsFindTopic(pInstance, resource);
+	if (t != NULL) {
+		subs = malloc(t->count * sizeof(Websock*));
+		if (subs == NULL) {
+			ESP_LOGE(TAG, "Can't allocate mem for %d subscribers", t->count);
+		} else {
+			n = t->count;
+			for (i = 0; i < n; i++) {
+				subs[i] = t->subs[i];
+				kref_get(&(subs[i]->ref_cnt)); // dropped once sent to
 			}
-			put_websock(ws); // decrement reference count for local copy
 		}
 	}
+	for (i = 0; i < n; i++) {
+		ws = subs[i];
+		if (check_websock_closed(ws)) continue;
+		kref_get(&(fb->ref_cnt)); // for the connection, dropped by wsFrameSent()
+		if (!httpdSendRefShared(ws->conn, fb->data, fb->len, wsFrameSent, fb)) {
+			// Something else is pending by reference; copy it
+			kref_put(&(fb->ref_cnt), free_frame);
+			if (!httpdSend(ws->conn, fb->data, fb->len)) continue;
+		}
+		httpdFlushSendBuffer(pInstance, ws->conn);
+		ret++;
+	}
+	for (i = 0; i < n; i++) put_websock(subs[i]);
+	httpdPlatUnlock(pInstance);
+	free(subs);
+	kref_put(&(fb->ref_cnt), free_frame);
+
 	if (ret == 0) {
 		ESP_LOGD(TAG, "No websockets found for resource %s", resource);
 	}
@@ -306,110 +415,219 @@ void ICACHE_FLASH_ATTR cgiWebsocketClose(HttpdInstance *pInstance, Websock *ws,
 	httpdPlatUnlock(pInstance);
 }
 
+//Unmasks len bytes of payload in place. The mask is applied a word at a time once data is word
+//aligned; that doesn't change which mask byte comes next, so only the odd bytes at the ends
+//move maskCtr along.
+static void ICACHE_FLASH_ATTR wsUnmask(WebsockPriv *priv, char *data, int len) {
+	typedef uint32_t __attribute__((__may_alias__)) WsWord;
+	uint8_t *p=(uint8_t*)data;
+	uint8_t m[4];
+	uint32_t mw;
+	int k;
+
+	while (len>0 && ((uintptr_t)p&3)!=0) {
+		*p++^=priv->fr.mask[(priv->maskCtr++)&3];
+		len--;
+	}
+	if (len>=4) {
+		for (k=0; k<4; k++) m[k]=priv->fr.mask[(priv->maskCtr+k)&3];
+		memcpy(&mw, m, 4);
+#ifdef __SSE2__
+		__m128i mv=_mm_set1_epi32(mw);
+		while (len>=16) {
+			_mm_storeu_si128((__m128i*)p, _mm_xor_si128(_mm_loadu_si128((__m128i*)p), mv));
+			p+=16;
+			len-=16;
+		}
+#endif
+		while (len>=4) {
+			*(WsWord*)p^=mw;
+			p+=4;
+			len-=4;
+		}
+	}
+	while (len>0) {
+		*p++^=priv->fr.mask[(priv->maskCtr++)&3];
+		len--;
+	}
+}
+
+//Parses a frame header that's all in data in one go. Returns its length, or 0 if data doesn't
+//hold all of it; the bytes are fed to wsParseHeaderByte() one by one then.
+static int ICACHE_FLASH_ATTR wsParseHeader(WebsockPriv *priv, const char *data, int len) {
+	const uint8_t *p=(const uint8_t*)data;
+	int hl=2, n, k;
+
+	if (len<2) return 0;
+	n=p[1]&PAYLOAD_MASK;
+	if (n==126) hl+=2;
+	else if (n==127) hl+=8;
+	if (p[1]&IS_MASKED) hl+=4;
+	if (len<hl) return 0;
+
+	priv->maskCtr=0;
+	priv->frameCont=0;
+	priv->fr.flags=p[0];
+	priv->fr.len8=p[1];
+	if (n<126) {
+		priv->fr.len=n;
+		k=2;
+	} else {
+		priv->fr.len=0;
+		for (k=2; k<((n==126)?4:10); k++) priv->fr.len=(priv->fr.len<<8)|p[k];
+	}
+	if (p[1]&IS_MASKED) memcpy(priv->fr.mask, p+k, 4);
+	priv->wsStatus=ST_PAYLOAD;
+	return hl;
+}
+
+//Feeds one byte of a frame header that arrives split over several receives.
+static void ICACHE_FLASH_ATTR wsParseHeaderByte(WebsockPriv *priv, uint8_t c) {
+	if (priv->wsStatus==ST_FLAGS) {
+		priv->maskCtr=0;
+		priv->frameCont=0;
+		priv->fr.flags=c;
+		priv->wsStatus=ST_LEN0;
+	} else if (priv->wsStatus==ST_LEN0) {
+		priv->fr.len8=c;
+		if ((priv->fr.len8&127)>=126) {
+			priv->fr.len=0;
+			priv->wsStatus=ST_LEN1;
+		} else {
+			priv->fr.len=priv->fr.len8&127;
+			priv->wsStatus=(priv->fr.len8&IS_MASKED)?ST_MASK1:ST_PAYLOAD;
+		}
+	} else if (priv->wsStatus<=ST_LEN8) {
+		priv->fr.len=(priv->fr.len<<8)|c;
+		if (((priv->fr.len8&127)==126 && priv->wsStatus==ST_LEN2) || priv->wsStatus==ST_LEN8) {
+			priv->wsStatus=(priv->fr.len8&IS_MASKED)?ST_MASK1:ST_PAYLOAD;
+		} else {
+			priv->wsStatus++;
+		}
+	} else if (priv->wsStatus<=ST_MASK4) {
+		priv->fr.mask[priv->wsStatus-ST_MASK1]=c;
+		priv->wsStatus++;
+	}
+}
+
+//Puts the payload of data frames together into whole messages for routes with a maxMessageLen,
+//and hands those to recvCb. A message that arrives whole, in one frame and one receive, is
+//passed on from the receive buffer; only the others are copied. Returns 0, or the code to close
+//the connection with: 1009 if the message is too large, 1011 if there's no memory for it.
+static int ICACHE_FLASH_ATTR wsCollect(Websock *ws, char *data, int len) {
+	WebsockPriv *priv=ws->priv;
+	bool fin=(priv->fr.flags&FLAG_FIN) && priv->fr.len==len;
+
+	if ((priv->fr.flags&OPCODE_MASK)!=OPCODE_CONTINUE && !priv->frameCont) {
+		//First frame of a message
+		wsMsgRelease(priv);
+		priv->msgFlags=((priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY)?WEBSOCK_FLAG_BIN:0;
+	}
+	//Known as soon as the frame header is in
+	if (priv->msgLen+priv->fr.len>priv->maxMessageLen) {
+		ESP_LOGW(TAG, "Message over %d bytes", priv->maxMessageLen);
+		wsMsgRelease(priv);
+		return 1009;
+	}
+	if (fin && priv->msgLen==0) {
+		if (ws->recvCb) ws->recvCb(ws, data, len, priv->msgFlags);
+		return 0;
+	}
+	if (priv->msg==NULL) {
+		priv->msg=wsMsgBufGet(priv->maxMessageLen);
+		if (priv->msg==NULL) {
+			ESP_LOGE(TAG, "Can't allocate %d bytes for message", priv->maxMessageLen);
+			return 1011;
+		}
+	}
+	memcpy(priv->msg->data+priv->msgLen, data, len);
+	priv->msgLen+=len;
+	if (fin) {
+		if (ws->recvCb) ws->recvCb(ws, priv->msg->data, priv->msgLen, priv->msgFlags);
+		wsMsgRelease(priv);
+	}
+	return 0;
+}
+
 CgiStatus ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *connData, char *data, int len) {
-	int i, j, sl;
+	int i=0, sl, hl, code;
 	int r=HTTPD_CGI_MORE;
-	int wasHeaderByte;
 	Websock *ws=(Websock*)connData->cgiData;
 	assert(ws != NULL);
 	kref_get(&(ws->ref_cnt)); // increment reference count
-	for (i=0; i<len; i++) {
-//		httpd_printf("Ws: State %d byte 0x%02X\n", ws->priv->wsStatus, data[i]);
-		wasHeaderByte=1;
-		if (ws->priv->wsStatus==ST_FLAGS) {
-			ws->priv->maskCtr=0;
-			ws->priv->frameCont=0;
-			ws->priv->fr.flags=(uint8_t)data[i];
-			ws->priv->wsStatus=ST_LEN0;
-		} else if (ws->priv->wsStatus==ST_LEN0) {
-			ws->priv->fr.len8=(uint8_t)data[i];
-			if ((ws->priv->fr.len8&127)>=126) {
-				ws->priv->fr.len=0;
-				ws->priv->wsStatus=ST_LEN1;
+	while (1) {
+		if (ws->priv->wsStatus!=ST_PAYLOAD) {
+			if (i>=len) break;
+			//Usually the whole header is in the buffer; only a header split over two receives
+			//goes through the state machine.
+			if (ws->priv->wsStatus==ST_FLAGS && (hl=wsParseHeader(ws->priv, data+i, len-i))>0) {
+				i+=hl;
 			} else {
-				ws->priv->fr.len=ws->priv->fr.len8&127;
-				ws->priv->wsStatus=(ws->priv->fr.len8&IS_MASKED)?ST_MASK1:ST_PAYLOAD;
+				wsParseHeaderByte(ws->priv, (uint8_t)data[i++]);
+				if (ws->priv->wsStatus!=ST_PAYLOAD) continue;
 			}
-		} else if (ws->priv->wsStatus<=ST_LEN8) {
-			ws->priv->fr.len=(ws->priv->fr.len<<8)|data[i];
-			if (((ws->priv->fr.len8&127)==126 && ws->priv->wsStatus==ST_LEN2) || ws->priv->wsStatus==ST_LEN8) {
-				ws->priv->wsStatus=(ws->priv->fr.len8&IS_MASKED)?ST_MASK1:ST_PAYLOAD;
-			} else {
-				ws->priv->wsStatus++;
-			}
-		} else if (ws->priv->wsStatus<=ST_MASK4) {
-			ws->priv->fr.mask[ws->priv->wsStatus-ST_MASK1]=data[i];
-			ws->priv->wsStatus++;
-		} else {
-			//Was a payload byte.
-			wasHeaderByte=0;
 		}
-
-		if (ws->priv->wsStatus==ST_PAYLOAD && wasHeaderByte) {
-			//We finished parsing the header, but i still is on the last header byte. Move one forward so
-			//the payload code works as usual.
-			i++;
-		}
-		//Also finish parsing frame if we haven't received any payload bytes yet, but the length of the frame
-		//is zero.
-		if (ws->priv->wsStatus==ST_PAYLOAD) {
-			//Okay, header is in; this is a data byte. We're going to process all the data bytes we have
-			//received here at the same time; no more byte iterations till the end of this frame.
-			//First, unmask the data
-			sl=len-i;
-			ESP_LOGD(TAG, "Frame payload. wasHeaderByte %d fr.len %d sl %d cmd 0x%x", wasHeaderByte, (int)ws->priv->fr.len, (int)sl, ws->priv->fr.flags);
-			if (sl > ws->priv->fr.len) sl=ws->priv->fr.len;
-			for (j=0; j<sl; j++) data[i+j]^=(ws->priv->fr.mask[(ws->priv->maskCtr++)&3]);
-
-//			httpd_printf("Unmasked: ");
-//			for (j=0; j<sl; j++) httpd_printf("%02X ", data[i+j]&0xff);
-//			httpd_printf("\n");
-
-			//Inspect the header to see what we need to do.
-			if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_PING) {
-				if (ws->priv->fr.len>125) {
-					if (!ws->priv->frameCont) cgiWebsocketClose(pInstance, ws, 1002);
-					r=HTTPD_CGI_DONE;
-					break;
-				} else {
-					if (!ws->priv->frameCont) sendFrameHead(ws, OPCODE_PONG|FLAG_FIN, ws->priv->fr.len);
-					if (sl>0) httpdSend(ws->conn, data+i, sl);
-				}
-			} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_TEXT ||
-						(ws->priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY ||
-						(ws->priv->fr.flags&OPCODE_MASK)==OPCODE_CONTINUE) {
-				if (sl>ws->priv->fr.len) sl=ws->priv->fr.len;
-				if (!(ws->priv->fr.len8&IS_MASKED)) {
-					//We're a server; client should send us masked packets.
-					cgiWebsocketClose(pInstance, ws, 1002);
-					r=HTTPD_CGI_DONE;
-					break;
-				} else {
-					int flags=0;
-					if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY) flags|=WEBSOCK_FLAG_BIN;
-					if ((ws->priv->fr.flags&FLAG_FIN)==0) flags|=WEBSOCK_FLAG_MORE;
-					if (ws->recvCb) ws->recvCb(ws, data+i, sl, flags);
-				}
-			} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_CLOSE) {
-				ESP_LOGD(TAG, "Got close frame");
-				cgiWebsocketClose(pInstance, ws, ((data[i]<<8)&0xff00)+(data[i+1]&0xff));
+		//Okay, header is in. We're going to process all the data bytes we have received here at the
+		//same time. A frame without payload is finished right away, otherwise wait for some.
+		sl=len-i;
+		if (sl>ws->priv->fr.len) sl=ws->priv->fr.len;
+		if (sl==0 && ws->priv->fr.len!=0) break;
+		ESP_LOGD(TAG, "Frame payload. fr.len %d sl %d cmd 0x%x", (int)ws->priv->fr.len, (int)sl, ws->priv->fr.flags);
+		//First, unmask the data
+		if (ws->priv->fr.len8&IS_MASKED) wsUnmask(ws->priv, data+i, sl);
+
+		//Inspect the header to see what we need to do.
+		if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_PING) {
+			if (ws->priv->fr.len>125) {
+				if (!ws->priv->frameCont) cgiWebsocketClose(pInstance, ws, 1002);
 				r=HTTPD_CGI_DONE;
 				break;
 			} else {
-				if (!ws->priv->frameCont) ESP_LOGE(TAG, "Unknown opcode 0x%X", ws->priv->fr.flags&OPCODE_MASK);
+				if (!ws->priv->frameCont) sendFrameHead(ws, OPCODE_PONG|FLAG_FIN, ws->priv->fr.len);
+				if (sl>0) httpdSend(ws->conn, data+i, sl);
 			}
-			i+=sl-1;
-			ws->priv->fr.len-=sl;
-			if (ws->priv->fr.len==0) {
-				ws->priv->wsStatus=ST_FLAGS; //go receive next frame
+		} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_TEXT ||
+					(ws->priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY ||
+					(ws->priv->fr.flags&OPCODE_MASK)==OPCODE_CONTINUE) {
+			if (!(ws->priv->fr.len8&IS_MASKED)) {
+				//We're a server; client should send us masked packets.
+				cgiWebsocketClose(pInstance, ws, 1002);
+				r=HTTPD_CGI_DONE;
+				break;
+			} else if (ws->priv->maxMessageLen>0) {
+				if ((code=wsCollect(ws, data+i, sl))!=0) {
+					cgiWebsocketClose(pInstance, ws, code);
+					r=HTTPD_CGI_DONE;
+					break;
+				}
 			} else {
-				ws->priv->frameCont=1; //next payload is continuation of this frame.
+				int flags=0;
+				if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY) flags|=WEBSOCK_FLAG_BIN;
+				if ((ws->priv->fr.flags&FLAG_FIN)==0) flags|=WEBSOCK_FLAG_MORE;
+				if (ws->recvCb) ws->recvCb(ws, data+i, sl, flags);
 			}
+		} else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_CLOSE) {
+			ESP_LOGD(TAG, "Got close frame");
+			//Echo the status code, if the close frame has one
+			cgiWebsocketClose(pInstance, ws, (sl>=2)?((data[i]<<8)&0xff00)+(data[i+1]&0xff):1000);
+			r=HTTPD_CGI_DONE;
+			break;
+		} else {
+			if (!ws->priv->frameCont) ESP_LOGE(TAG, "Unknown opcode 0x%X", ws->priv->fr.flags&OPCODE_MASK);
+		}
+		i+=sl;
+		ws->priv->fr.len-=sl;
+		if (ws->priv->fr.len==0) {
+			ws->priv->wsStatus=ST_FLAGS; //go receive next frame
+		} else {
+			ws->priv->frameCont=1; //next payload is continuation of this frame.
 		}
 	}
 	if (r==HTTPD_CGI_DONE) {
 		//We're going to tell the main webserver we're done. The webserver expects us to clean up by ourselves
 		//we're chosing to be done. Do so.
+		wsMsgRelease(ws->priv);
+		wsUnsubscribe(ws);
 		put_websock((Websock*)connData->cgiData); // drop reference for connData->cgiData
 		connData->cgiData=NULL;
 	}
@@ -426,6 +644,8 @@ CgiStatus ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 		//Connection aborted. Clean up.
 		ESP_LOGD(TAG, "Cleanup");
 		if (connData->cgiData) {
+			wsMsgRelease(((Websock*)connData->cgiData)->priv);
+			wsUnsubscribe((Websock*)connData->cgiData);
 			((Websock*)connData->cgiData)->conn = NULL; // mark as closed for shared references
 			put_websock((Websock*)connData->cgiData); // drop reference for connData->cgiData
 			connData->cgiData=NULL;
@@ -460,6 +680,9 @@ CgiStatus ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 					return HTTPD_CGI_DONE;
 				}
 
+				const WebsockOpts *opts=connData->cgiArg2;
+				if (opts!=NULL) ws->priv->maxMessageLen=opts->maxMessageLen;
+
 				// Store a reference to the connData, but note that ws doesn't own it. 
 				// We have to be careful using it because it can be freed by the httpd instance.
 				ws->conn=connData;
@@ -484,7 +707,9 @@ CgiStatus ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 				kref_get(&(ws->ref_cnt));
 				connData->cgiData = ws;
 
-				wsListAddAndGC(ws); // add to list, will add another reference count
+				httpdPlatLock(connData->pInstance);
+				wsSubscribe(connData->pInstance, ws);
+				httpdPlatUnlock(connData->pInstance);
 
 				put_websock(ws); // drop reference to local ws
 				return HTTPD_CGI_MORE;
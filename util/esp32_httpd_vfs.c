@@ -17,6 +17,9 @@ Connector to let httpd use the vfs filesystem to serve the files in it.
 #include "httpd-platform.h"
 #include "cJSON.h"
 #include "libesphttpd/cgi_common.h"
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+#include "httpd-gunzip.h"
+#endif
 
 #define FILE_CHUNK_LEN    (1024)
 #define MAX_FILENAME_LENGTH (1024)
@@ -24,19 +27,107 @@ Connector to let httpd use the vfs filesystem to serve the files in it.
 #define ESPFS_MAGIC (0x73665345)
 #define ESPFS_FLAG_GZIP (1<<1)
 
+#ifndef CONFIG_ESPHTTPD_VFS_STAT_CACHE_ENTRIES
+#define CONFIG_ESPHTTPD_VFS_STAT_CACHE_ENTRIES 32
+#endif
+
+#ifndef CONFIG_ESPHTTPD_VFS_STAT_CACHE_TTL_MS
+#define CONFIG_ESPHTTPD_VFS_STAT_CACHE_TTL_MS 2000
+#endif
+
+// Uploads are written in pieces of this size; a multiple of the filesystem's block size.
+#ifndef CONFIG_ESPHTTPD_VFS_UPLOAD_BUF_LEN
+#define CONFIG_ESPHTTPD_VFS_UPLOAD_BUF_LEN 8192
+#endif
+
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
-static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
+// What stat() said about a path, kept for a while since each lookup on flash takes milliseconds
+// and a page load makes dozens of them, most for the same few paths. Paths that don't exist are
+// kept too. Each path maps to a single slot, like the variant caches.
+typedef struct {
+	uint32_t hash;		// httpdPathHash() of the path, 0 if the slot is unused
+	uint32_t expires;	// httpdPlatGetTimeMs() it goes stale at
+	uint8_t type;		// VFS_STAT_*
+	bool gzipFlagged;	// A file of an espfs image that's stored gzipped
+	off_t size;
+	time_t mtime;
+} VfsStat;
+
+#define VFS_STAT_NONE 0
+#define VFS_STAT_FILE 1
+#define VFS_STAT_DIR 2
+
+// Shared by all server instances, so only touched with httpdPlatSharedLock() held.
+static VfsStat statCache[CONFIG_ESPHTTPD_VFS_STAT_CACHE_ENTRIES];
+
+// stat() through the cache. Returns the VFS_STAT_* type of the path, the rest goes to *st if
+// it isn't NULL. The lock isn't held during the stat() itself.
+static uint8_t vfsStat(const char *path, VfsStat *st)
 {
 	struct stat s;
+	uint32_t h = httpdPathHash(path);
+	uint32_t now = httpdPlatGetTimeMs();
+	VfsStat *e = &statCache[h % CONFIG_ESPHTTPD_VFS_STAT_CACHE_ENTRIES];
+	VfsStat v;
+
+	httpdPlatSharedLock();
+	v = *e;
+	httpdPlatSharedUnlock();
+	if (v.hash != h || (CONFIG_ESPHTTPD_VFS_STAT_CACHE_TTL_MS > 0 && (int32_t)(now - v.expires) >= 0)) {
+		memset(&v, 0, sizeof(VfsStat));
+		if (stat(path, &s) == 0) {
+			if (S_ISREG(s.st_mode)) {
+				v.type = VFS_STAT_FILE;
+				v.gzipFlagged = (s.st_spare4[0] == ESPFS_MAGIC && s.st_spare4[1] & ESPFS_FLAG_GZIP);
+				v.size = s.st_size;
+				v.mtime = s.st_mtime;
+			} else if (S_ISDIR(s.st_mode)) {
+				v.type = VFS_STAT_DIR;
+			}
+		}
+		v.hash = h;
+		v.expires = now + CONFIG_ESPHTTPD_VFS_STAT_CACHE_TTL_MS;
+		httpdPlatSharedLock();
+		*e = v;
+		httpdPlatSharedUnlock();
+	}
+	if (st != NULL) *st = v;
+	return v.type;
+}
+
+void cgiEspVfsInvalidate(const char *path)
+{
+	char variant[MAX_FILENAME_LENGTH + 1];
+	HttpdEncoding enc;
+	uint32_t h;
+
+	httpdPlatSharedLock();
+	if (path == NULL) {
+		memset(statCache, 0, sizeof(statCache));
+	} else {
+		// The path and its precompressed variants
+		for (enc = 0; enc < HTTPD_ENC_COUNT; enc++) {
+			snprintf(variant, sizeof(variant), "%s%s", path, httpdEncodingSuffix(enc));
+			h = httpdPathHash(variant);
+			if (statCache[h % CONFIG_ESPHTTPD_VFS_STAT_CACHE_ENTRIES].hash == h) {
+				statCache[h % CONFIG_ESPHTTPD_VFS_STAT_CACHE_ENTRIES].hash = 0;
+			}
+		}
+	}
+	httpdPlatSharedUnlock();
+}
+
+static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
+{
 	int outlen;
 
 	if (connData->cgiArg != &httpdCgiEx) {
 		filepath[0] = '\0';
 		if (connData->cgiArg != NULL) {
 			outlen = strlcpy(filepath, connData->cgiArg, len);
-			if (stat(filepath, &s) == 0 && S_ISREG(s.st_mode)) {
+			if (vfsStat(filepath, NULL) == VFS_STAT_FILE) {
 				return outlen;
 			}
 		}
@@ -61,7 +152,7 @@ static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
 	}
 
 	outlen = strlcpy(filepath, ex->basepath, len);
-	if (stat(ex->basepath, &s) != 0 || S_ISDIR(s.st_mode)) {
+	if (vfsStat(ex->basepath, NULL) != VFS_STAT_FILE) {
 		if (ex->basepath[basepathLen - 1] != '/') {
 			strlcat(filepath, "/", len);
 		}
@@ -70,29 +161,107 @@ static size_t getFilepath(HttpdConnData *connData, char *filepath, size_t len)
 	return outlen;
 }
 
+typedef struct {
+	FILE *file;
+	size_t remaining;	// bytes of the response body still to be sent
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+	HttpdGunzip *gunzip;	// decompresses the file, if the client can't take it gzipped
+#endif
+} VfsGetState;
+
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+static int gunzipRead(void *arg, char *buf, int len)
+{
+	size_t n = fread(buf, 1, len, (FILE *)arg);
+	return (n == 0 && ferror((FILE *)arg)) ? -1 : (int)n;
+}
+#endif
+
+// Releases what cgiEspVfsGet() holds for a response.
+static void freeVfsGetState(VfsGetState *state)
+{
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+	if (state->gunzip != NULL) {
+		httpdGunzipFree(state->gunzip);
+	}
+#endif
+	fclose(state->file);
+	free(state);
+}
+
+// Set besides the HTTPD_ENC_BIT()s by getVariants() for a directory; the variants are those of
+// its index.html then.
+#define VARIANT_INDEX (1<<7)
+
+// Finds out which variants of a file exist: filename.br, filename.gz and filename itself.
+// The suffixes are tried by appending them to filename, which has room for size bytes and
+// is left as it was.
+static uint8_t getVariants(char *filename, size_t size)
+{
+	size_t len = strlen(filename);
+	size_t baseLen = len;
+	uint8_t variants = 0;
+	HttpdEncoding enc;
+
+	if (vfsStat(filename, NULL) == VFS_STAT_DIR) {
+		variants = VARIANT_INDEX;
+		baseLen = strlcat(filename, "/index.html", size);
+	}
+	for (enc = 0; enc < HTTPD_ENC_COUNT; enc++) {
+		if (strlcat(filename, httpdEncodingSuffix(enc), size) < size &&
+				vfsStat(filename, NULL) == VFS_STAT_FILE) {
+			variants |= HTTPD_ENC_BIT(enc);
+		}
+		filename[baseLen] = '\0';
+	}
+	filename[len] = '\0';
+	return variants;
+}
+
+static int vfsGetRead(void *ctx, char *buf, int len)
+{
+	VfsGetState *state = (VfsGetState *)ctx;
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+	if (state->gunzip != NULL) {
+		return httpdGunzipRead(state->gunzip, buf, len);
+	}
+#endif
+	size_t n = fread(buf, 1, len, state->file);
+	return (n == 0 && ferror(state->file)) ? -1 : (int)n;
+}
+
+static void vfsGetClose(void *ctx)
+{
+	freeVfsGetState((VfsGetState *)ctx);
+	ESP_LOGD(__func__, "fclose");
+}
+
+static const HttpdStreamOps vfsGetStreamOps = {
+	.read = vfsGetRead,
+	.close = vfsGetClose,
+};
+
 CgiStatus ICACHE_FLASH_ATTR cgiEspVfsGet(HttpdConnData *connData) {
-	FILE *file=connData->cgiData;
-	int len;
-	char buff[FILE_CHUNK_LEN];
+	VfsGetState *state=connData->cgiData;
+	FILE *file=NULL;
+	char buff[64];
 	char filename[MAX_FILENAME_LENGTH + 1];
-	char acceptEncodingBuffer[64];
-	int isGzip;
+	const char *encoding = NULL;
 	bool isIndex = false;
-	struct stat filestat;	
+	VfsStat filestat;
 
 	if (connData->isConnectionClosed) {
 		//Connection aborted. Clean up.
-		if(file != NULL){
-			fclose(file);
-			ESP_LOGD(__func__, "fclose: %s, r", filename);
+		if(state != NULL){
+			freeVfsGetState(state);
+			ESP_LOGD(__func__, "fclose");
 		}
 		ESP_LOGE(__func__, "Connection aborted!");
 		return HTTPD_CGI_DONE;
 	}
 
 	//First call to this cgi.
-	if (file==NULL) {
-		isGzip = 0;
+	if (state==NULL) {
 		if (connData->requestType!=HTTPD_METHOD_GET) {
 			return HTTPD_CGI_NOTFOUND;  //	return and allow another cgi function to handle it
 		}
@@ -100,48 +269,111 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspVfsGet(HttpdConnData *connData) {
 		getFilepath(connData, filename, sizeof(filename));
 		
 		if(filename[strlen(filename)-1]=='/') filename[strlen(filename)-1]='\0';
-		if(stat(filename, &filestat) == 0) {
-			if((isIndex = S_ISDIR(filestat.st_mode))) {
-				strncat(filename, "/index.html", MAX_FILENAME_LENGTH - strlen(filename));
-			}
+		uint8_t variants = getVariants(filename, sizeof(filename));
+		unsigned int available = variants & (HTTPD_ENC_BIT(HTTPD_ENC_COUNT) - 1);
+		if (available == 0) {
+			return HTTPD_CGI_NOTFOUND;
+		}
+		if ((isIndex = (variants & VARIANT_INDEX))) {
+			strncat(filename, "/index.html", MAX_FILENAME_LENGTH - strlen(filename));
 		}
 
-		file = fopen(filename, "r");
-		if (file != NULL) {
-			struct stat st = {};
-			fstat(fileno(file), &st);
-			isGzip = (st.st_spare4[0] == ESPFS_MAGIC && st.st_spare4[1] & ESPFS_FLAG_GZIP);
-			ESP_LOGD(__func__, "fopen: %s, r", filename);
+		HttpdEncoding enc = httpdNegotiateEncoding(connData, available);
+		bool gunzip = false;
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+		// A client that doesn't take gzip can still get the .gz variant, decompressed
+		// while it's sent.
+		if (enc == HTTPD_ENC_COUNT && (available & HTTPD_ENC_BIT(HTTPD_ENC_GZIP)) &&
+				httpdGetEncodingQ(connData, "identity") > 0) {
+			enc = HTTPD_ENC_GZIP;
+			gunzip = true;
 		}
-		
-		if (file==NULL) {
-			// Check if requested file is available GZIP compressed ie. with file extension .gz
-		
-			strncat(filename, ".gz", MAX_FILENAME_LENGTH - strlen(filename));
-			ESP_LOGD(__func__, "GET: GZIPped file - %s", filename);
+#endif
+		if (enc == HTTPD_ENC_COUNT) {
+			// The client takes none of the encodings the file is stored in (telnet users for e.g.)
+			httpdSend(connData, gzipNonSupportedMessage, -1);
+			ESP_LOGE(__func__, "client does not accept any variant of %s", filename);
+			return HTTPD_CGI_DONE;
+		}
+		strncat(filename, httpdEncodingSuffix(enc), MAX_FILENAME_LENGTH - strlen(filename));
+		ESP_LOGD(__func__, "GET: %s", filename);
+		if (vfsStat(filename, &filestat) != VFS_STAT_FILE) {
+			return HTTPD_CGI_NOTFOUND;
+		}
+		if (enc != HTTPD_ENC_IDENTITY && !gunzip) {
+			encoding = httpdEncodingName(enc);
+		} else if (enc == HTTPD_ENC_IDENTITY && filestat.gzipFlagged) {
+			// A file of an espfs image that's stored gzipped goes out as it is
+			encoding = "gzip";
+		}
+
+		// The entity tag comes from the size and modification time we already have from stat(),
+		// so a client with a current copy gets its 304 without the file ever being opened.
+		// The variant is part of the tag, so caches can't mix up the encodings.
+		const char *variant = gunzip ? "gunzip" : encoding;
+		char etag[48];
+		snprintf(etag, sizeof(etag), "\"%lx-%lx%s%s\"", (unsigned long)filestat.mtime, (unsigned long)filestat.size,
+				variant ? "-" : "", variant ? variant : "");
+		bool notModified = httpdEtagMatches(connData, etag);
+
+		long start = 0, end = (long)filestat.size - 1;
+		HttpdRangeResult range = HTTPD_RANGE_NONE;
+		// No ranges of a file being decompressed, the offsets would be into the compressed data
+		if (!notModified && !gunzip) {
+			range = httpdGetRange(connData, filestat.size, etag, &start, &end);
+		}
+
+		if (range == HTTPD_RANGE_UNSATISFIABLE) {
+			snprintf(buff, sizeof(buff), "bytes */%ld", (long)filestat.size);
+			httpdSetContentLength(connData, 0);
+			httpdStartResponse(connData, 416);
+			httpdHeader(connData, "Content-Range", buff);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+
+		if (!notModified) {
 			file = fopen(filename, "r");
-			if (file != NULL) ESP_LOGD(__func__, "fopen: %s, r", filename);
-			isGzip = 1;
-			
-			if (file==NULL) {
+			if (file == NULL) {
 				return HTTPD_CGI_NOTFOUND;
-			}				
-		
-			// Check the browser's "Accept-Encoding" header. If the client does not
-			// advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-			httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64);
-			if (strstr(acceptEncodingBuffer, "gzip") == NULL) {
-				//No Accept-Encoding: gzip header present
-				httpdSend(connData, gzipNonSupportedMessage, -1);
+			}
+			ESP_LOGD(__func__, "fopen: %s, r", filename);
+			if (range == HTTPD_RANGE_OK && fseek(file, start, SEEK_SET) != 0) {
+				ESP_LOGE(__func__, "seek to %ld failed, sending whole file", start);
+				rewind(file);
+				range = HTTPD_RANGE_NONE;
+				start = 0;
+				end = (long)filestat.size - 1;
+			}
+
+			state = malloc(sizeof(VfsGetState));
+			if (state == NULL) {
+				ESP_LOGE(__func__, "Can't allocate state");
 				fclose(file);
-				ESP_LOGD(__func__, "fclose: %s, r", filename);
-				ESP_LOGE(__func__, "client does not accept gzip!");
-				return HTTPD_CGI_DONE;
+				return HTTPD_CGI_NOTFOUND;
+			}
+			state->file = file;
+			state->remaining = end - start + 1;
+#ifdef CONFIG_ESPHTTPD_GUNZIP_SUPPORT
+			state->gunzip = NULL;
+			if (gunzip) {
+				state->gunzip = httpdGunzipNew(gunzipRead, file);
+				if (state->gunzip == NULL) {
+					// Too many files being decompressed already
+					freeVfsGetState(state);
+					httpdSend(connData, gzipNonSupportedMessage, -1);
+					return HTTPD_CGI_DONE;
+				}
+			}
+#endif
+			connData->cgiData = state;
+			// The decompressed length isn't known up front, that body goes out chunked
+			if (!gunzip) {
+				httpdSetContentLength(connData, state->remaining);
 			}
 		}
 
-		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
+		httpdStartResponse(connData, notModified ? 304 : ((range == HTTPD_RANGE_OK) ? 206 : 200));
 
 		const char *mimetype = NULL;
 		bool sendContentType = false;
@@ -163,11 +395,24 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspVfsGet(HttpdConnData *connData) {
 			if (!mimetype) {
 				mimetype = isIndex ? httpdGetMimetype("index.html") : httpdGetMimetype(connData->url);
 			}
-			httpdHeader(connData, "Content-Type", mimetype);
+			if (!notModified) {
+				httpdHeader(connData, "Content-Type", mimetype);
+			}
+		}
+
+		if (encoding && !notModified) {
+			httpdHeader(connData, "Content-Encoding", encoding);
+		}
+		// What's sent depends on the client's Accept-Encoding if there's a compressed variant
+		if (available != HTTPD_ENC_BIT(HTTPD_ENC_IDENTITY)) {
+			httpdHeader(connData, "Vary", "Accept-Encoding");
 		}
 
-		if (isGzip) {
-			httpdHeader(connData, "Content-Encoding", "gzip");
+		httpdHeader(connData, "ETag", etag);
+		httpdHeader(connData, "Accept-Ranges", gunzip ? "none" : "bytes");
+		if (range == HTTPD_RANGE_OK) {
+			snprintf(buff, sizeof(buff), "bytes %ld-%ld/%ld", start, end, (long)filestat.size);
+			httpdHeader(connData, "Content-Range", buff);
 		}
 
 		if (connData->cgiArg == &httpdCgiEx) {
@@ -182,21 +427,14 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspVfsGet(HttpdConnData *connData) {
 			httpdAddCacheHeaders(connData, mimetype);
 		}
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_MORE;
-	}
-
-	len=fread(buff, 1, FILE_CHUNK_LEN, file);
-	if (len>0) httpdSend(connData, buff, len);
-	if (len!=FILE_CHUNK_LEN) {
-		//We're done.
-		fclose(file);
-		ESP_LOGD(__func__, "fclose: %s, r", filename);
-
-		return HTTPD_CGI_DONE;
-	} else {
-		//Ok, till next time.
-		return HTTPD_CGI_MORE;
+		if (notModified) {
+			return HTTPD_CGI_DONE;
+		}
+		// The server reads the rest as the connection takes it
+		connData->cgiData = NULL;
+		return httpdServeStream(connData, &vfsGetStreamOps, state, gunzip ? -1 : (long)state->remaining);
 	}
+	return HTTPD_CGI_DONE;
 }
 
 typedef struct {
@@ -376,14 +614,71 @@ static esp_err_t createMissingDirectories(char *fullpath) {
 	return err;
 }
 
+// An upload goes to filename.tmp first and replaces the file only once it's complete, so a
+// broken off upload doesn't leave half a file behind.
+#define UPLOAD_TMP_SUFFIX ".tmp"
+
 typedef struct {
 	enum {UPSTATE_START, UPSTATE_WRITE, UPSTATE_DONE, UPSTATE_ERR} state;
 	FILE *file;
 	char filename[MAX_FILENAME_LENGTH + 1];
+	char tmpname[MAX_FILENAME_LENGTH + sizeof(UPLOAD_TMP_SUFFIX)];
+	char *buf;		// Received data not written yet, CONFIG_ESPHTTPD_VFS_UPLOAD_BUF_LEN bytes
+	int bufLen;
 	int b_written;
 	const char *errtxt;
 } UploadState;
 
+// Writes out the buffered data. The buffer is only written when it's full and at the end, so
+// every write but the last is a whole number of filesystem blocks at a block boundary.
+static bool uploadFlush(UploadState *state)
+{
+	int count = fwrite(state->buf, 1, state->bufLen, state->file);
+	bool ok = (count == state->bufLen);
+	state->b_written += count;
+	state->bufLen = 0;
+	return ok;
+}
+
+// Drops the temporary file of an upload that didn't make it.
+static void uploadAbort(UploadState *state)
+{
+	if (state->file != NULL) {
+		fclose(state->file);
+		state->file = NULL;
+		unlink(state->tmpname);
+		ESP_LOGD(__func__, "removed %s", state->tmpname);
+	}
+}
+
+// Closes the temporary file and puts it in the place of the uploaded file.
+static bool uploadFinish(UploadState *state)
+{
+	int r = fclose(state->file);
+	state->file = NULL;
+	if (r != 0) {
+		unlink(state->tmpname);
+		return false;
+	}
+	if (rename(state->tmpname, state->filename) != 0) {
+		// FAT doesn't rename over an existing file
+		unlink(state->filename);
+		if (rename(state->tmpname, state->filename) != 0) {
+			ESP_LOGE(__func__, "can't rename %s; errno=%d", state->tmpname, errno);
+			unlink(state->tmpname);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void freeUploadState(UploadState *state)
+{
+	uploadAbort(state);
+	free(state->buf);
+	free(state);
+}
+
 CgiStatus   cgiEspVfsUpload(HttpdConnData *connData) {
 	UploadState *state=(UploadState *)connData->cgiData;
     
@@ -391,11 +686,7 @@ CgiStatus   cgiEspVfsUpload(HttpdConnData *connData) {
 		//Connection aborted. Clean up.
 		if (state != NULL)
 		{
-			if(state->file != NULL){
-				fclose(state->file);
-				ESP_LOGD(__func__, "fclose: %s, r", state->filename);
-			}
-			free(state);
+			freeUploadState(state);
 		}
 		ESP_LOGE(__func__, "Connection aborted!");
 		return HTTPD_CGI_DONE;
@@ -485,8 +776,19 @@ CgiStatus   cgiEspVfsUpload(HttpdConnData *connData) {
 			goto error_first;
 		}
 
-		// Open file for writing
-		state->file = fopen(state->filename, "w");
+		state->buf = malloc(CONFIG_ESPHTTPD_VFS_UPLOAD_BUF_LEN);
+		if (state->buf == NULL)
+		{
+			ESP_LOGE(__func__, "Can't allocate upload buffer");
+			state->errtxt="Out of memory!";
+			state->state=UPSTATE_ERR;
+			goto error_first;
+		}
+
+		// Open the temporary file for writing
+		strlcpy(state->tmpname, state->filename, sizeof(state->tmpname));
+		strlcat(state->tmpname, UPLOAD_TMP_SUFFIX, sizeof(state->tmpname));
+		state->file = fopen(state->tmpname, "w");
 		if (state->file == NULL)
 		{
 			ESP_LOGE(__func__, "Can't open file for writing!");
@@ -494,9 +796,11 @@ CgiStatus   cgiEspVfsUpload(HttpdConnData *connData) {
 			state->state=UPSTATE_ERR;
 			goto error_first;
 		}
+		// The data is buffered here already, in larger pieces than stdio would
+		setvbuf(state->file, NULL, _IONBF, 0);
 
 		state->state=UPSTATE_WRITE;
-		ESP_LOGD(__func__, "fopen: %s, w", state->filename);
+		ESP_LOGD(__func__, "fopen: %s, w", state->tmpname);
 
 error_first:
 		connData->cgiData=state;
@@ -506,15 +810,27 @@ error_first:
 
 	if (state->state==UPSTATE_WRITE) {
 		if(state->file != NULL){
-			int count = fwrite(connData->post.buff, 1, connData->post.buffLen, state->file);
-			state->b_written += count;
-			if (count != connData->post.buffLen)
-			{
-				state->state=UPSTATE_ERR;
-				ESP_LOGE(__func__, "error writing to filesystem!");
+			const char *data = connData->post.buff;
+			int len = connData->post.buffLen;
+			while (len > 0 && state->state == UPSTATE_WRITE) {
+				int n = CONFIG_ESPHTTPD_VFS_UPLOAD_BUF_LEN - state->bufLen;
+				if (n > len) n = len;
+				memcpy(state->buf + state->bufLen, data, n);
+				state->bufLen += n;
+				data += n;
+				len -= n;
+				if (state->bufLen == CONFIG_ESPHTTPD_VFS_UPLOAD_BUF_LEN && !uploadFlush(state)) {
+					state->state=UPSTATE_ERR;
+					ESP_LOGE(__func__, "error writing to filesystem!");
+				}
 			}
-			if (state->b_written >= connData->post.len){
-				state->state=UPSTATE_DONE;
+			if (state->state == UPSTATE_WRITE && connData->post.received >= connData->post.len) {
+				if (!uploadFlush(state) || !uploadFinish(state)) {
+					state->state=UPSTATE_ERR;
+					ESP_LOGE(__func__, "error writing to filesystem!");
+				} else {
+					state->state=UPSTATE_DONE;
+				}
 			}
 		} // else, Just eat up any bytes we receive.
 	} else if (state->state==UPSTATE_DONE) {
@@ -527,9 +843,10 @@ error_first:
 	if (connData->post.received == connData->post.len) {
 		//We're done.
 		cJSON *jsroot = cJSON_CreateObject();
-		if(state->file != NULL){
-			fclose(state->file);
-			ESP_LOGD(__func__, "fclose: %s, r", state->filename);
+		if (state->state==UPSTATE_DONE) {
+			ESP_LOGD(__func__, "renamed to %s", state->filename);
+			// The file may be a new variant of something, or a new index.html, or in new directories
+			cgiEspVfsInvalidate(NULL);
 		}
 		ESP_LOGI(__func__, "Total: %d bytes written.", state->b_written);
 
@@ -537,7 +854,7 @@ error_first:
 		cJSON_AddNumberToObject(jsroot, "bytes received", connData->post.received);
 		cJSON_AddNumberToObject(jsroot, "bytes written", state->b_written);
 		cJSON_AddBoolToObject(jsroot, "success", state->state==UPSTATE_DONE);
-		free(state);
+		freeUploadState(state);
 
 		cgiJsonResponseCommonSingle(connData, jsroot); // Send the json response!
 		return HTTPD_CGI_DONE;